@@ -6,6 +6,13 @@
 #include <atomic>
 #include <mutex>
 #include <cstring>
+#include <deque>
+#include <list>
+#include <map>
+#include <queue>
+
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
 
 #include "filecopy.h"
 #include "gatherdir.h"
@@ -13,6 +20,50 @@
 #include "ringbuffer.h"
 #include "hashlibpp.h"
 
+/* Files at least this large are split into ranges that several
+copiers move at once, when there is more than one copier */
+#ifndef SPLIT_FILE_THRESHOLD
+    #define SPLIT_FILE_THRESHOLD            ((size_t)(1024)*(1024)*(1024))
+#endif
+#ifndef SPLIT_RANGE_SIZE
+    #define SPLIT_RANGE_SIZE                ((size_t)(256)*(1024)*(1024))
+#endif
+
+/* Split files are written beside the destination under this
+suffix, and renamed once every range is in */
+#ifndef SPLIT_PARTIAL_SUFFIX
+    #define SPLIT_PARTIAL_SUFFIX            ".part"
+#endif
+
+/* Copiers allowed on one device at a time.  A spinning disk
+gets a single stream so copies do not seek against each other;
+0 leaves solid state devices unlimited. */
+#ifndef ROTATIONAL_DEVICE_STREAMS
+    #define ROTATIONAL_DEVICE_STREAMS       1
+#endif
+#ifndef SOLID_STATE_DEVICE_STREAMS
+    #define SOLID_STATE_DEVICE_STREAMS      0
+#endif
+
+/* Files a copier claims at once from an unlimited lane are the
+files left in it over this many times the number of copiers,
+capped, so batches shrink toward single files as the lane empties */
+#ifndef WORK_BATCH_DIVISOR
+    #define WORK_BATCH_DIVISOR              2
+#endif
+#ifndef WORK_BATCH_MAX
+    #define WORK_BATCH_MAX                  64
+#endif
+
+/* Copiers kept for the small file lanes, and how many small
+files they open and close together */
+#ifndef SMALL_FILE_WORKERS
+    #define SMALL_FILE_WORKERS              1
+#endif
+#ifndef SMALL_FILE_BATCH
+    #define SMALL_FILE_BATCH                32
+#endif
+
 enum treeslinger_err
 {
     CHECKSUM_CONTAINER_IS_NULL = 1001,
@@ -23,6 +74,48 @@ enum treeslinger_err
     DEST_NOT_HASHED = 1006,
     FILE_NUM_MISMATCH = 1007,
     CHECKSUM_LIST_LENGTH_MISMATCH = 1008,
+    UNKNOWN_HASH_ALGORITHM = 1009,
+};
+
+struct SplitFile
+{
+    /* A large file whose ranges are shared out between copiers.
+    Guarded by the split lock. */
+    size_t index, size, rangeSize, numRanges, nextRange, rangesLeft, bytesMoved;
+};
+
+struct DeviceLane
+{
+    /* Files read from and written to the same set of devices,
+    largest first.  Claimed from the front, while batches take
+    their small files from the back.  Guarded by the source
+    queue lock. */
+    std::vector<dev_t> devices;
+    std::vector<size_t> indexes;
+    size_t next, end;
+    bool limited, small;
+};
+
+struct WorkQueue
+{
+    /* Files a copier has claimed ahead.  The owner takes from
+    the front and idle copiers steal from the back. */
+    std::mutex lock;
+    std::deque<size_t> files;
+};
+
+struct LaneStats
+{
+    /* Files and bytes through the small or large file lane, and
+    when its first file started and its last finished */
+    size_t numFiles, numBytes;
+    std::chrono::steady_clock::time_point start, stop;
+};
+
+struct DeviceSlots
+{
+    /* Copiers working on a device, and how many it allows */
+    unsigned limit, active;
 };
 
 class TreeSlinger
@@ -32,8 +125,32 @@ public:
     bool
         _sourceHashed,
         _destHashed,
-        _hashInline;
+        _hashInline,
+        _reflink,
+        _direct,
+        _threaded,
+        _sparse,
+        _preallocate,
+        _adaptive,
+        _resume,
+        _deviceAware,
+        _largestFirst;
     int _parentPathLength;
+    unsigned _queueDepth;
+    size_t _extentHint;
+    cache_policy _cachePolicy;
+    size_t _smallFileThreshold;
+    size_t _chunkSize;
+    uint8_t _ringDepth;
+    size_t _splitThreshold, _splitRangeSize;
+    size_t _checkpointInterval;
+    skip_policy _skipPolicy;
+    size_t _blockDigestSize;
+    uint8_t _mirrorLag;
+    unsigned _rotationalStreams, _solidStateStreams;
+    unsigned _smallFileWorkers;
+    std::vector<std::filesystem::path> _mirrorRoots;
+    copy_engine _engine;
     size_t
         _size,
         _transferred;
@@ -42,15 +159,32 @@ public:
         _destQueueIndex;
     std::mutex
         _sourceQueueLock,
-        _destQueueLock,
         _progressLock,
-        _printLock;
+        _printLock,
+        _splitLock;
     GatherDir _gatherer;
     BasicProgressBar<double> _progress;
     std::vector<FileCopy> _copiers;
     std::vector<std::filesystem::path>* _destFiles;
     std::vector<std::thread> _threads, _sourceHasherThreads, _destHasherThreads;
     std::vector<std::string> *_sourceChecksums, *_destChecksums;
+    std::vector<size_t>* _bytesMoved;
+    std::vector<std::vector<size_t>>* _mirrorBytesMoved;
+    std::vector<int>* _copyErrors;
+    std::vector<std::vector<block_digest>>* _blockDigests;
+    std::list<SplitFile> _splitFiles;
+    std::vector<DeviceLane> _lanes;
+    std::vector<size_t> _fileLanes, _fileSizes;
+    std::map<dev_t, DeviceSlots> _devices;
+    std::vector<WorkQueue> _workQueues;
+    size_t _nextLane, _numUnclaimed;
+    size_t _predictedMakespan, _predictedSpread;
+    LaneStats _laneStats[2];
+    bool _pipelined, _copiersDone;
+    std::deque<size_t> _completedFiles;
+    std::mutex _completionLock;
+    std::condition_variable _fileCompleted;
+    std::condition_variable _deviceFreed;
     
     virtual std::filesystem::path _strip_parent_path(
             std::filesystem::path asset
@@ -60,18 +194,68 @@ public:
         );
     
     virtual void reset();
+    virtual void _configure_copier(FileCopy* copier);
     virtual void _create_copiers(int num);
     virtual int _num_copiers();
     virtual void _reset_copiers();
 
     virtual void _increment_progress(size_t chunk);
+    virtual void _complete_file(size_t index);
+    virtual void _run_verifier();
+    virtual void _record_lane(
+            size_t index,
+            size_t numBytes,
+            std::chrono::steady_clock::time_point start
+        );
     virtual int _get_next_source_index();
     virtual int _get_next_dest_index();
+    virtual unsigned _device_streams(dev_t device);
+    virtual void _group_by_device();
+    virtual void _predict_completion();
+    virtual bool _lane_limited(size_t lane);
+    virtual int _worker_lane(size_t worker);
+    virtual bool _small_lanes();
+    virtual bool _is_small_file(size_t index);
+    virtual bool _lanes_drained(int small);
+    virtual bool _claim_file(size_t worker, size_t* index, bool wait);
+    virtual bool _steal_files(size_t worker, size_t* index, bool anyLane);
+    virtual void _release_file(size_t index);
 
     virtual void _sys_file_copy();
+    virtual bool _split_file(FileCopy* copier, size_t index);
+    virtual bool _copy_split_range(FileCopy* copier);
+    virtual void _store_block_digests(FileCopy* copier, size_t index);
+    virtual void _store_mirror_bytes(FileCopy* copier, size_t index);
+    virtual void _record_copy_error(size_t index, file_mover_err err);
+    virtual std::filesystem::path _get_mirror_dest(
+            size_t mirror,
+            std::filesystem::path destAsset
+        );
+    virtual void _open_mirrors(FileCopy* copier, size_t index);
+    virtual void _open_batch(
+            UringQueue* queue,
+            const std::vector<size_t>& indexes,
+            std::vector<int>* sourceFds,
+            std::vector<int>* destFds
+        );
+    virtual void _close_batch(UringQueue* queue, std::vector<int>* fds);
+    virtual void _copy_small_batch(
+            FileCopy* copier,
+            size_t worker,
+            size_t first,
+            UringQueue* queue
+        );
     virtual void _run_copier(FileCopy* copier, const size_t totalNumFiles);
     virtual void _spawn_thread(FileCopy* copier);
+    virtual bool _start_uring_copy(
+            FileCopy* copier,
+            size_t* index,
+            std::chrono::steady_clock::time_point* start,
+            const size_t totalNumFiles
+        );
+    virtual void _run_uring_copiers(const size_t totalNumFiles);
 
+    virtual hashwrapper* _create_hasher();
     virtual void _run_source_hasher(const size_t totalNumFiles);
     virtual void _run_dest_hasher(const size_t totalNumFiles);
     virtual void _spawn_source_hasher_thread();
@@ -82,11 +266,13 @@ public:
     virtual size_t _get_total_size();
     virtual void _allocate_checksums();
     virtual bool _checksums_allocated();
+    virtual void _allocate_transfer_records();
     
     virtual void _hash_source();
     virtual void _hash_dest();
     
     virtual void _create_csv();
+    virtual bool _checksums_match();
     
 public:
     std::filesystem::path source, destination;
@@ -104,6 +290,35 @@ public:
     virtual void set_destination(std::filesystem::path destPath);
     virtual void set_hash_algorithm(const char* algo);
     virtual void set_hash_inline(bool hashInline = true);
+    virtual void set_reflink(bool reflink = true);
+    virtual void set_direct(bool direct = true);
+    virtual void set_threaded(bool threaded = true);
+    virtual void set_sparse(bool sparse = true);
+    virtual void set_preallocate(bool preallocate = true);
+    virtual void set_extent_hint(size_t numBytes);
+    virtual void set_cache_policy(cache_policy policy);
+    virtual void set_small_file_threshold(size_t numBytes);
+    virtual void set_chunk_size(size_t numBytes);
+    virtual void set_ring_depth(uint8_t depth);
+    virtual void set_adaptive_geometry(bool adaptive = true);
+    virtual void set_split_threshold(size_t numBytes);
+    virtual void set_split_range_size(size_t numBytes);
+    virtual void set_resume(bool resume = true);
+    virtual void set_checkpoint_interval(size_t numBytes);
+    virtual void set_skip_policy(skip_policy policy);
+    virtual void set_block_digest_size(size_t numBytes);
+    virtual void add_mirror_destination(std::filesystem::path mirrorPath);
+    virtual void set_mirror_lag(uint8_t numSlots);
+    virtual void set_device_aware(bool deviceAware = true);
+    virtual void set_device_streams(unsigned rotational, unsigned solidState);
+    virtual void set_largest_first(bool largestFirst = true);
+    virtual size_t get_predicted_spread();
+    virtual size_t get_predicted_makespan();
+    virtual void set_small_file_workers(unsigned numWorkers);
+    virtual double get_lane_throughput(bool smallFiles);
+    virtual double get_lane_file_rate(bool smallFiles);
+    virtual void set_engine(copy_engine engine);
+    virtual void set_queue_depth(unsigned depth);
     
     virtual std::vector<std::filesystem::path>* get_source_files();
     virtual std::vector<std::filesystem::path>* get_dest_files();
@@ -119,9 +334,14 @@ public:
     virtual void _stage();
     virtual bool verify();
     virtual bool verify_threaded(int numThreads);
+    virtual bool copy_and_verify(int numVerifiers);
+    virtual bool repair();
     // virtual size_t execute();
     virtual std::vector<std::string>* get_source_checksums() const;
     virtual std::vector<std::string>* get_dest_checksums() const;
+    virtual std::vector<size_t>* get_bytes_moved() const;
+    virtual std::vector<std::vector<size_t>>* get_mirror_bytes_moved() const;
+    virtual std::vector<int>* get_copy_errors() const;
 };
 
 #endif
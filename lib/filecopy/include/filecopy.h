@@ -3,13 +3,126 @@
 
 #include <fstream>
 #include <filesystem>
+#include <iterator>
+
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <exception>
+#include <limits>
+#include <csetjmp>
+#include <csignal>
+#include <map>
+#include <mutex>
+#include <thread>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <linux/fs.h>
+
+#if defined(__x86_64__)
+    #include <immintrin.h>
+#endif
 
 #include "ringbuffer.h"
+#include "uringqueue.h"
+#include "hashlibpp.h"
 
 #ifndef RING_BUFFER_CHUNKSIZE
     #define RING_BUFFER_CHUNKSIZE           ((1024)*(1024))
 #endif
 
+#ifndef RING_BUFFER_DEPTH
+    #define RING_BUFFER_DEPTH               4
+#endif
+
+/* Limits and targets for adaptive buffer geometry.  The chunk
+size is tuned so one chunk takes between the low and high
+latency, and the ring deepens when chunk latency is erratic. */
+#ifndef ADAPTIVE_CHUNK_MIN
+    #define ADAPTIVE_CHUNK_MIN              ((256)*(1024))
+#endif
+#ifndef ADAPTIVE_CHUNK_MAX
+    #define ADAPTIVE_CHUNK_MAX              ((64)*(1024)*(1024))
+#endif
+#ifndef ADAPTIVE_DEPTH_MAX
+    #define ADAPTIVE_DEPTH_MAX              16
+#endif
+#ifndef ADAPTIVE_LATENCY_LOW
+    #define ADAPTIVE_LATENCY_LOW            0.004
+#endif
+#ifndef ADAPTIVE_LATENCY_HIGH
+    #define ADAPTIVE_LATENCY_HIGH           0.064
+#endif
+#ifndef ADAPTIVE_MIN_SAMPLES
+    #define ADAPTIVE_MIN_SAMPLES            4
+#endif
+
+/* Granularity of zero detection when copying sparse */
+#ifndef SPARSE_BLOCK_SIZE
+    #define SPARSE_BLOCK_SIZE               ((64)*(1024))
+#endif
+
+/* Largest source moved with one read and one write by default */
+#ifndef SMALL_FILE_THRESHOLD
+    #define SMALL_FILE_THRESHOLD            ((64)*(1024))
+#endif
+
+/* Smallest source that gets an extent size hint, when one is set */
+#ifndef EXTENT_HINT_MIN_FILESIZE
+    #define EXTENT_HINT_MIN_FILESIZE        ((1024)*(1024)*(1024))
+#endif
+
+/* Bytes copied between source hash checkpoints when resuming,
+and the suffix of the checkpoint file kept beside the destination */
+#ifndef RESUME_CHECKPOINT_INTERVAL
+    #define RESUME_CHECKPOINT_INTERVAL      ((1024)*(1024)*(1024))
+#endif
+#ifndef RESUME_CHECKPOINT_SUFFIX
+    #define RESUME_CHECKPOINT_SUFFIX        ".resume"
+#endif
+
+/* Blocks compared by the sampled skip policy, and their size */
+#ifndef SKIP_SAMPLE_COUNT
+    #define SKIP_SAMPLE_COUNT               8
+#endif
+#ifndef SKIP_SAMPLE_SIZE
+    #define SKIP_SAMPLE_SIZE                ((64)*(1024))
+#endif
+
+/* Checksum compared by the checksum skip policy when the
+source is not being hashed inline */
+#ifndef SKIP_CHECKSUM_ALGORITHM
+    #define SKIP_CHECKSUM_ALGORITHM         "md5"
+#endif
+
+/* Source bytes covered by each block digest when they are
+recorded, and how often a block is rewritten during a repair
+before giving up on it */
+#ifndef BLOCK_DIGEST_SIZE
+    #define BLOCK_DIGEST_SIZE               ((1024)*(1024))
+#endif
+#ifndef BLOCK_REPAIR_ATTEMPTS
+    #define BLOCK_REPAIR_ATTEMPTS           3
+#endif
+
+/* CRC-32C of one block of the source; blocks the copy did not
+see whole have none */
+typedef uint64_t block_digest;
+#define BLOCK_DIGEST_NONE                   (~static_cast<block_digest>(0))
+
+/* Ring slots a mirrored copy lets its fastest destination run
+ahead of its slowest before the reader waits */
+#ifndef MIRROR_LAG_SLOTS
+    #define MIRROR_LAG_SLOTS                8
+#endif
+
 enum file_mover_err
 {
     READ_WRITE_MISMATCH = 101,
@@ -19,6 +132,104 @@ enum file_mover_err
     SOURCE_NOT_SET = 120,
     DEST_DIR_NOT_SET = 121,
     DEST_NOT_SET = 122,
+    SOURCE_OPEN_FAILED = 123,
+    DEST_OPEN_FAILED = 124,
+    SOURCE_READ_FAILED = 125,
+    DEST_WRITE_FAILED = 126,
+    SOURCE_TRUNCATED = 127,
+    BLOCK_REPAIR_FAILED = 128,
+    KERNEL_COPY_FAILED = 130,
+};
+
+enum copy_engine
+{
+    /* Bounces data through the ring buffer with iostreams */
+    ENGINE_STREAM = 0,
+
+    /* Moves data between file descriptors inside the kernel */
+    ENGINE_KERNEL = 1,
+
+    /* Keeps several ring buffer reads and writes in flight with io_uring */
+    ENGINE_URING = 2,
+
+    /* Writes straight from a mapping of the source */
+    ENGINE_MMAP = 3,
+
+    /* Fills and drains the whole ring per syscall with preadv
+    and pwritev at explicit offsets */
+    ENGINE_POSITIONAL = 4,
+};
+
+enum cache_policy
+{
+    /* Leaves the page cache to the kernel */
+    CACHE_KEEP = 0,
+
+    /* Marks the source sequential and reads ahead of the writer */
+    CACHE_SEQUENTIAL = 1,
+
+    /* Also writes behind the writer and drops both files'
+    pages once they are on disk */
+    CACHE_DROP = 2,
+};
+
+enum skip_policy
+{
+    /* Skips any destination that exists and is not empty */
+    SKIP_EXISTS = 0,
+
+    /* Skips a destination the size of the source, written
+    no earlier than the source last changed */
+    SKIP_SIZE_MTIME = 1,
+
+    /* Also compares blocks sampled across both files */
+    SKIP_SAMPLED = 2,
+
+    /* Also compares checksums of both whole files */
+    SKIP_CHECKSUM = 3,
+};
+
+enum kernel_copy_method
+{
+    KERNEL_COPY_FILE_RANGE = 0,
+    KERNEL_SENDFILE = 1,
+    KERNEL_SPLICE = 2,
+};
+
+enum uring_slot_state
+{
+    SLOT_FREE = 0,
+    SLOT_READING = 1,
+    SLOT_WRITING = 2,
+    SLOT_WRITE_PENDING = 3,
+    SLOT_HASH_PENDING = 4,
+    SLOT_READ_PENDING = 5,
+};
+
+class FileCopy;
+
+struct BufferGeometry
+{
+    size_t chunkSize;
+    uint8_t ringDepth;
+};
+
+struct TransferLatency
+{
+    /* Time spent in reads or writes of whole chunks */
+    size_t numChunks;
+    double totalSeconds, maxSeconds;
+};
+
+struct UringSlot
+{
+    /* Tracks one ring buffer slot while it is owned by io_uring.
+    Its address is the user data of every request it makes. */
+    FileCopy* owner;
+    uint8_t index;
+    uring_slot_state state;
+    size_t offset, length, done;
+    bool hashed;
 };
 
 
@@ -28,13 +239,108 @@ protected:
 public:
     bool
         _firstWritten,
-        _overwrite;
+        _overwrite,
+        _reflink,
+        _direct,
+        _threaded,
+        _sparse,
+        _preallocate,
+        _adaptive,
+        _ranged,
+        _resume;
 
     size_t
         _sourceSizeInBytes,
         _destSizeInBytes,
         _numBytesReadToBuffer,
-        _numBytesWrittenFromBuffer;
+        _numBytesWrittenFromBuffer,
+        _numBytesCloned;
+
+    /* Modification times in nanoseconds, taken with the sizes
+    as the files are opened */
+    int64_t _sourceMtime, _destMtime;
+
+    copy_engine _engine;
+    kernel_copy_method _kernelMethod;
+    skip_policy _skipPolicy;
+
+    int _inFd, _outFd, _pipeFds[2];
+
+    /* Bytes held in each ring slot, and the length of the
+    source hole skipped just before it when copying sparse */
+    std::vector<size_t> _slotLengths, _slotGaps;
+    off_t _sourceDataEnd;
+    size_t _sparseTail;
+
+    /* Extent size hint in bytes for large destinations; 0 is off */
+    size_t _extentHint;
+
+    /* Page cache advice, and how far into the destination
+    it has been given and pages released */
+    cache_policy _cachePolicy;
+    size_t _advisedOffset, _releasedOffset;
+
+    /* Sources up to this size skip the ring buffer; 0 is off */
+    size_t _smallFileThreshold;
+
+    /* Chunk timings gathered for adaptive geometry, and the
+    devices they were measured between */
+    TransferLatency _readLatency, _writeLatency;
+    std::pair<dev_t, dev_t> _devices;
+
+    /* Geometry in use before a learned one replaced it, put back
+    for devices nothing has been learned about */
+    BufferGeometry _configuredGeometry;
+    bool _geometryLearned;
+
+    unsigned _queueDepth, _uringInFlight;
+    bool _uringSourceEnded;
+    size_t _uringReadOffset, _uringHashOffset;
+
+    /* Where a read found the end of the source, and the
+    end of the furthest data read from it */
+    size_t _uringSourceEnd, _uringDataEnd;
+    std::vector<UringSlot> _uringSlots;
+    UringQueue* _uring;
+    UringQueue _ownUring;
+
+    /* Descriptors handed back for the caller to close in a batch
+    instead of one at a time, when set */
+    std::vector<int>* _deferredCloses;
+
+    char* _sourceMap;
+    size_t _mapOffset;
+
+    /* Byte range of the source copied in place by set_range().
+    Without a range, the offset is where a resumed copy starts. */
+    size_t _rangeOffset, _rangeLength;
+
+    /* Per block digests of the source: the block size, how far
+    the source has been digested, where the block being digested
+    was joined, its running CRC and the digests so far */
+    size_t _digestBlockSize, _digestOffset, _digestFrom;
+    uint32_t _digestCrc;
+    std::vector<block_digest> _blockDigests;
+
+    /* Extra destinations fed from the same source reads, their
+    descriptors (-1 once one is left alone), the bytes written to
+    each, and how many ring slots they may drift apart */
+    std::vector<std::filesystem::path> _mirrorPaths;
+    std::vector<int> _mirrorFds;
+    std::vector<size_t> _mirrorBytesWritten;
+    uint8_t _mirrorLag;
+
+    /* Bytes between source hash checkpoints, and the offset
+    the last one was taken at */
+    size_t _checkpointInterval, _checkpointOffset;
+
+    /* Offset reached by the positional engine, and its vectors */
+    size_t _positionalOffset;
+    std::vector<struct iovec> _slotVectors;
+
+    bool _hashStarted;
+    std::string _hashAlgorithm, _sourceChecksum;
+    hashwrapper* _hasher;
 
     std::ifstream _inStream;
     std::ofstream _outStream;
@@ -46,6 +352,78 @@ public:
     void _check_file_size_match();
     std::filesystem::path _rename_dest();
 
+    bool _uses_fd();
+    bool _source_open();
+    bool _dest_open();
+    int _open_fd(const char* filepath, int flags);
+    void _open_source_fd();
+    void _open_dest_fd();
+    void _close_fd(int* fd);
+    bool _is_direct(int fd);
+    size_t _read_fd(char* data, size_t numBytes);
+    size_t _write_fd(char* data, size_t numBytes);
+    size_t _write_fd(int fd, char* data, size_t numBytes);
+    size_t _write_slot_fd(int numBytesAvailable);
+    void _clear_direct(int fd);
+    size_t _map_slot_vectors(size_t numBytes);
+    size_t _preadv_fd(size_t numBytes, size_t offset);
+    size_t _pwritev_fd(size_t numBytes, size_t offset);
+    size_t _seek_source_data(size_t* gap);
+    size_t _write_sparse(char* data, size_t numBytes);
+    bool _extend_sparse_dest();
+    void _set_dest_extent_hint(int fd);
+    void _preallocate_dest();
+    size_t _advice_window();
+    void _advise_progress();
+    void _release_cache(int sourceFd, int destFd, size_t end);
+    void _release_cache_tail();
+    std::filesystem::path _checkpoint_path();
+    bool _load_checkpoint(size_t limit);
+    void _write_checkpoint();
+    void _resume_from_dest();
+    void _hash_source_prefix();
+    void _stat_source(int fd = -1);
+    bool _stat_dest(int fd = -1);
+    bool _sampled_match(const std::filesystem::path& path);
+    std::string _checksum_file(const std::filesystem::path& path, hashwrapper* hasher);
+    bool _checksum_match(const std::filesystem::path& path);
+    bool _dest_matches(const std::filesystem::path& path, size_t size, int64_t mtime);
+    bool _mirrored();
+    void _run_fan_out();
+    void _check_existing_dest();
+    size_t _read_source(char* data, size_t numBytes);
+    size_t _write_dest(char* data, size_t numBytes);
+    bool _kernel_fallback(int err);
+    ssize_t _splice_chunk(size_t length);
+    ssize_t _kernel_copy_chunk(size_t length);
+    void _hash_start();
+    void _hash_chunk(const char* data, size_t numBytes);
+    void _hash_zeros(size_t numBytes);
+    void _uring_hash_in_order();
+    void _hash_mapped(const char* data, size_t numBytes);
+    bool _mapping_truncated(const char* data);
+    void _digest_source(const char* data, size_t numBytes, size_t offset);
+    bool _read_block(int fd, char* data, size_t numBytes, size_t offset);
+    void _write_block(int fd, const char* data, size_t numBytes, size_t offset);
+    bool _map_source();
+    void _unmap_source();
+    bool _uring_ready();
+    void _uring_prepare();
+    void _uring_read(UringSlot* slot);
+    void _uring_write(UringSlot* slot);
+    std::chrono::steady_clock::time_point _latency_start();
+    void _record_latency(
+            TransferLatency* latency,
+            std::chrono::steady_clock::time_point start
+        );
+    std::pair<dev_t, dev_t> _device_pair();
+    void _apply_learned_geometry();
+    void _learn_geometry();
+    bool _small_file();
+    copy_engine _effective_engine();
+    void _run_buffered();
+    void _run_threaded();
+
 public:
     bool started;
     std::filesystem::path source, dest;
@@ -53,16 +431,50 @@ public:
     FileCopy();
     FileCopy(const FileCopy& obj);
     ~FileCopy();
+
+    void set_engine(copy_engine engine);
+    copy_engine get_engine();
+    void set_reflink(bool reflink = true);
+    void set_direct(bool direct = true);
+    void set_threaded(bool threaded = true);
+    void set_sparse(bool sparse = true);
+    void set_preallocate(bool preallocate = true);
+    void set_extent_hint(size_t numBytes);
+    void set_cache_policy(cache_policy policy);
+    void set_small_file_threshold(size_t numBytes);
+    void set_chunk_size(size_t numBytes);
+    void set_ring_depth(uint8_t depth);
+    void set_adaptive_geometry(bool adaptive = true);
+    void set_range(size_t offset, size_t numBytes);
+    void set_resume(bool resume = true);
+    void set_checkpoint_interval(size_t numBytes);
+    void set_skip_policy(skip_policy policy);
+    void set_block_digest_size(size_t numBytes);
+    void set_mirror_lag(uint8_t numSlots);
+    BufferGeometry get_geometry();
+    void set_queue_depth(unsigned depth);
+    void set_uring(UringQueue* queue);
+    void set_deferred_closes(std::vector<int>* fds);
+    void set_hash_algorithm(const char* algo);
     
     void open_source(std::filesystem::path filepath);
+    void open_source(std::filesystem::path filepath, int fd);
     void open_source(const char* filepath);
     void open_dest(std::filesystem::path filepath);
+    void open_dest(std::filesystem::path filepath, int fd);
     void open_dest(const char* filepath);
     void open_dest();
+    void open_mirror(std::filesystem::path filepath);
     
     size_t get_source_size();
     size_t get_dest_size();
     size_t bytes_remaining();
+    size_t bytes_moved();
+    size_t bytes_cloned();
+    size_t mirror_bytes_moved(size_t mirror);
+    bool hashed();
+    std::string get_source_checksum();
+    const std::vector<block_digest>& get_block_digests();
     
     bool ready();
     void close();
@@ -73,7 +485,27 @@ public:
     size_t write_from_buffer();
     size_t write_processed_from_buffer();
     void pre_buffer_source();
+    size_t kernel_transfer();
+    bool clone();
+    size_t mmap_transfer();
+    size_t positional_transfer();
+    size_t small_transfer();
+
+    void uring_submit();
+    void uring_complete(UringSlot* slot, int32_t result);
+    static void uring_dispatch(const UringCompletion& completion);
+    bool uring_done();
+    size_t uring_transfer();
+
+    bool should_skip();
+    bool prepare();
+    size_t finish();
     size_t execute();
+    size_t repair(
+            std::filesystem::path sourcePath,
+            std::filesystem::path destPath,
+            const std::vector<block_digest>& digests
+        );
 };
 
 #endif
@@ -2,6 +2,7 @@
 #define RINGBUFFER_H
 
 #include <algorithm>
+#include <atomic>
 #include <cstdint>
 #include <cmath>
 #include <iostream>
@@ -9,8 +10,19 @@
 #include <limits>
 #include <vector>
 #include <map>
+#include <new>
 #include <stdexcept>
 
+#ifndef RING_BUFFER_ALIGNMENT
+    #define RING_BUFFER_ALIGNMENT           4096
+#endif
+
+/* Processing stages a slot can pass through between the
+producer and the consumer in single producer/consumer mode */
+#ifndef RING_BUFFER_MAX_STAGES
+    #define RING_BUFFER_MAX_STAGES          8
+#endif
+
 
 namespace Buffer
 {
@@ -19,6 +31,7 @@ enum ringbuffer_err
 {
     RING_SIZE_TOO_SHORT = 140,
     BUFFER_NOT_INITIALIZED = 150,
+    TOO_MANY_STAGES = 151,
 };
 
 template <typename T>
@@ -33,6 +46,47 @@ constexpr T get_zero()
         ) ? (value - 1) : 0;
 }
 
+template <typename T>
+class AlignedAllocator
+{
+    /* Allocates storage on RING_BUFFER_ALIGNMENT boundaries
+    so buffers can be handed directly to O_DIRECT I/O */
+public:
+    typedef T value_type;
+
+    AlignedAllocator() noexcept {}
+    template <typename U>
+    AlignedAllocator(const AlignedAllocator<U>&) noexcept {}
+
+    T* allocate(size_t length)
+    {
+        return static_cast<T*>(::operator new(
+                length * sizeof(T),
+                std::align_val_t(RING_BUFFER_ALIGNMENT)
+            ));
+    }
+
+    void deallocate(T* data, size_t length) noexcept
+    {
+        ::operator delete(data, std::align_val_t(RING_BUFFER_ALIGNMENT));
+    }
+
+    template <typename U>
+    bool operator==(const AlignedAllocator<U>&) const noexcept
+    {
+        return true;
+    }
+
+    template <typename U>
+    bool operator!=(const AlignedAllocator<U>&) const noexcept
+    {
+        return false;
+    }
+};
+
+template <typename T>
+using AlignedVector = std::vector<T, AlignedAllocator<T>>;
+
 class Ring
 {
 public:
@@ -53,6 +107,34 @@ protected:
         _totalWritableLength, _buffered,
         _samplesWritten, _samplesRemaining, _samplesProcessed;
 
+    /* Slots handed to the reader and not yet read.  Samples alone
+    cannot tell this once slots are only partly filled. */
+    int _buffersFilled;
+    void _fill_buffer();
+    void _release_buffer();
+
+    /* Single producer/consumer state.  Slot counts only ever grow;
+    the ring index of a slot is its count modulo ringLength.
+    The top bit of both counts marks the ring as closed. */
+    static constexpr uint64_t SPSC_CLOSED = uint64_t(1) << 63;
+    std::atomic<uint64_t> _slotsProduced, _slotsConsumed;
+    std::vector<uint32_t> _slotLengths;
+
+    /* Slots each stage has finished with.  A stage follows the
+    one before it, or the producer, and the consumer follows the
+    last stage, so a slot only returns to the producer once every
+    stage has had it.  A stage marks its count closed once the
+    stage before it is closed and drained. */
+    std::atomic<uint64_t> _slotsStaged[RING_BUFFER_MAX_STAGES];
+    uint8_t _numStages;
+
+    std::atomic<uint64_t>& _upstream(uint8_t stage);
+    T* _acquire_from(
+            std::atomic<uint64_t>& upstream,
+            std::atomic<uint64_t>& cursor,
+            uint32_t* length
+        );
+
     bool _size_is_set();
 
 public:
@@ -62,7 +144,7 @@ public:
         bytesPerSample,
         bytesPerBuffer;
     uint8_t readIndex, writeIndex, processingIndex;
-    std::vector<std::vector<T>> ring;
+    std::vector<AlignedVector<T>> ring;
     std::map<uint8_t, bool> bufferProcessedState;
 
     RingBuffer();
@@ -95,12 +177,12 @@ public:
     virtual void rotate_partial_write(unsigned int length, bool force = false);
     virtual void rotate_partial_processing(unsigned int length);
 
-    virtual uint8_t get_ring_index(std::vector<T>* bufferPtr);
+    virtual uint8_t get_ring_index(AlignedVector<T>* bufferPtr);
     virtual uint8_t get_ring_index(uint8_t* bufferPtr);
 
-    virtual std::vector<T>* get_read_buffer();
-    virtual std::vector<T>* get_write_buffer();
-    virtual std::vector<T>* get_processing_buffer();
+    virtual AlignedVector<T>* get_read_buffer();
+    virtual AlignedVector<T>* get_write_buffer();
+    virtual AlignedVector<T>* get_processing_buffer();
 
     virtual uint8_t* get_read_byte();
     virtual uint8_t* get_write_byte();
@@ -142,11 +224,26 @@ protected:
     virtual bool _is_buffer_processed(uint8_t ringIndex);
 
 public:
-    virtual void set_buffer_processed(std::vector<T>* bufferPtr, bool state);
+    virtual void set_buffer_processed(AlignedVector<T>* bufferPtr, bool state);
     virtual void set_buffer_processed(uint8_t* bufferPtr, bool state);
 
-    virtual bool is_buffer_processed(std::vector<T>* bufferPtr);
+    virtual bool is_buffer_processed(AlignedVector<T>* bufferPtr);
     virtual bool is_buffer_processed(uint8_t* bufferPtr);
+
+/*                     Single producer/consumer                     */
+
+public:
+    virtual void spsc_reset();
+    virtual T* spsc_acquire_write();
+    virtual void spsc_commit_write(uint32_t length);
+    virtual void spsc_close();
+    virtual T* spsc_acquire_read(uint32_t* length);
+    virtual void spsc_release_read();
+
+    virtual void spsc_set_stages(uint8_t numStages);
+    virtual uint8_t spsc_stages();
+    virtual T* stage_acquire(uint8_t stage, uint32_t* length);
+    virtual void stage_release(uint8_t stage);
 };
 
 };
@@ -17,6 +17,10 @@ Ring::~Ring()
 template <typename T>
 RingBuffer<T>::RingBuffer() :
 Ring(),
+_buffersFilled(0),
+_slotsProduced(0),
+_slotsConsumed(0),
+_numStages(0),
 bufferLength(0)
 {
 }
@@ -28,6 +32,10 @@ _buffered(0),
 _samplesWritten(0),
 _samplesRemaining(bufferSize),
 _samplesProcessed(0),
+_buffersFilled(0),
+_slotsProduced(0),
+_slotsConsumed(0),
+_numStages(0),
 bufferLength(bufferSize),
 bytesPerSample(sizeof(T)),
 bytesPerBuffer(bufferSize * sizeof(T)),
@@ -45,7 +53,7 @@ processingIndex(0)
     this->ring.reserve(this->ringLength);
     for (int i(0); i < this->ringLength; ++i)
     {
-        this->ring.emplace_back(std::vector<T>());
+        this->ring.emplace_back(AlignedVector<T>());
         this->ring[i].reserve(this->bufferLength);
         for (uint32_t j(0); j < this->bufferLength; ++j)
         {
@@ -56,6 +64,7 @@ processingIndex(0)
     {
         this->bufferProcessedState.emplace(std::make_pair(i, false));
     }
+    this->_slotLengths.assign(this->ringLength, 0);
 }
 
 template <typename T>
@@ -80,11 +89,12 @@ void RingBuffer<T>::set_size(int bufferSize, uint8_t ringSize)
     this->_samplesRemaining = this->bufferLength;
     this->_samplesWritten = 0;
     this->_buffered = 0;
-    this->ring = std::vector<std::vector<T>>();
+    this->_buffersFilled = 0;
+    this->ring = std::vector<AlignedVector<T>>();
     this->ring.reserve(this->ringLength);
     for (int i(0); i < this->ringLength; ++i)
     {
-        this->ring.emplace_back(std::vector<T>());
+        this->ring.emplace_back(AlignedVector<T>());
         this->ring[i].reserve(this->bufferLength);
         for (uint32_t j(0); j < this->bufferLength; ++j)
         {
@@ -94,6 +104,8 @@ void RingBuffer<T>::set_size(int bufferSize, uint8_t ringSize)
     this->readIndex = 0;
     this->writeIndex = 1;
     this->processingIndex = 0;
+    this->_slotLengths.assign(this->ringLength, 0);
+    spsc_reset();
 }
 
 template <typename T>
@@ -129,6 +141,7 @@ void RingBuffer<T>::reset(bool zeroFill)
     this->_samplesRemaining = this->bufferLength;
     this->_samplesWritten = 0;
     this->_buffered = 0;
+    this->_buffersFilled = 0;
     this->readIndex = 0;
     this->writeIndex = 1;
     this->processingIndex = 0;
@@ -136,6 +149,7 @@ void RingBuffer<T>::reset(bool zeroFill)
     {
         this->bufferProcessedState[i] = false;
     }
+    spsc_reset();
 }
 
 template <typename T>
@@ -165,14 +179,16 @@ template <typename T>
 int RingBuffer<T>::buffers_buffered()
 {
     /* Total number of unread readable buffers */
-    return (this->_buffered / this->bufferLength);
+    return this->_buffersFilled;
 }
 
 template <typename T>
 int RingBuffer<T>::buffers_available()
 {
-    /* Total number of writable buffers */
-    return (available() / this->bufferLength);
+    /* Total number of writable buffers.  Counted in slots
+    rather than samples, as a partly filled slot still holds
+    unread data until it is read. */
+    return (this->ringLength - 1) - this->_buffersFilled;
 }
 
 template <typename T>
@@ -223,11 +239,26 @@ inline void RingBuffer<T>::rotate_processing_index()
     }
 }
 
+template <typename T>
+inline void RingBuffer<T>::_fill_buffer()
+{
+    /* Counts a slot handed to the reader, however full */
+    if (this->_buffersFilled < this->ringLength - 1) ++this->_buffersFilled;
+}
+
+template <typename T>
+inline void RingBuffer<T>::_release_buffer()
+{
+    /* Counts a slot handed back to the writer */
+    if (this->_buffersFilled > 0) --this->_buffersFilled;
+}
+
 template <typename T>
 void RingBuffer<T>::rotate_read_buffer(bool force)
 {
     /* Rotates read buffer and forces write buffer forward if overrun */
     rotate_read_index();
+    _release_buffer();
     this->_buffered -= this->bufferLength;
     this->_buffered = (this->_buffered < 0) ? 0 : this->_buffered;
     this->_samplesProcessed -= this->bufferLength;
@@ -249,6 +280,7 @@ void RingBuffer<T>::rotate_write_buffer(bool force)
     this->_samplesWritten = 0;
     this->_samplesRemaining = this->bufferLength;
     this->_buffered += this->bufferLength;
+    _fill_buffer();
     _set_buffer_processed(this->writeIndex, false);
     if (force && !is_writable())
     {
@@ -278,6 +310,7 @@ void RingBuffer<T>::rotate_partial_read(unsigned int length, bool force)
     #endif
 
     rotate_read_index();
+    _release_buffer();
     this->_buffered -= length;
     this->_buffered = (this->_buffered < 0) ? 0 : this->_buffered;
     this->_samplesProcessed -= length;
@@ -311,6 +344,7 @@ void RingBuffer<T>::rotate_partial_write(unsigned int length, bool force)
             (this->_buffered > this->_totalWritableLength)
             ? this->_totalWritableLength : this->_buffered
         );
+    _fill_buffer();
     _set_buffer_processed(this->writeIndex, false);
     if (force && !is_writable())
     {
@@ -341,7 +375,7 @@ void RingBuffer<T>::rotate_partial_processing(unsigned int length)
 
 
 template <typename T>
-inline uint8_t RingBuffer<T>::get_ring_index(std::vector<T>* bufferPtr)
+inline uint8_t RingBuffer<T>::get_ring_index(AlignedVector<T>* bufferPtr)
 {
     /* Returns ring index for buffer at pointer */
     #ifdef _DEBUG
@@ -383,21 +417,21 @@ inline uint8_t RingBuffer<T>::get_ring_index(uint8_t* bufferPtr)
 }
 
 template <typename T>
-inline std::vector<T>* RingBuffer<T>::get_read_buffer()
+inline AlignedVector<T>* RingBuffer<T>::get_read_buffer()
 {
     /* Returns pointer to current read buffer */
     return &(this->ring[this->readIndex]);
 }
 
 template <typename T>
-inline std::vector<T>* RingBuffer<T>::get_write_buffer()
+inline AlignedVector<T>* RingBuffer<T>::get_write_buffer()
 {
     /* Returns pointer to current write buffer */
     return &(this->ring[this->writeIndex]);
 }
 
 template <typename T>
-std::vector<T>* RingBuffer<T>::get_processing_buffer()
+AlignedVector<T>* RingBuffer<T>::get_processing_buffer()
 {
     /* Returns pointer to current processing buffer */
     return &(this->ring[this->processingIndex]);
@@ -434,7 +468,10 @@ template <typename T>
 inline const std::vector<T> RingBuffer<T>::_read() const
 {
     /* Returns current read buffer */
-    return this->ring[this->readIndex];
+    return std::vector<T>(
+            this->ring[this->readIndex].begin(),
+            this->ring[this->readIndex].end()
+        );
 }
 
 template <typename T>
@@ -627,7 +664,7 @@ inline void RingBuffer<T>::_set_buffer_processed(uint8_t ringIndex, bool state)
 }
 
 template <typename T>
-void RingBuffer<T>::set_buffer_processed(std::vector<T>* bufferPtr, bool state)
+void RingBuffer<T>::set_buffer_processed(AlignedVector<T>* bufferPtr, bool state)
 {
     /* Set whether the specified buffer has been processed */
     _set_buffer_processed(get_ring_index(bufferPtr), state);
@@ -648,7 +685,7 @@ bool RingBuffer<T>::_is_buffer_processed(uint8_t ringIndex)
 }
 
 template <typename T>
-bool RingBuffer<T>::is_buffer_processed(std::vector<T>* bufferPtr)
+bool RingBuffer<T>::is_buffer_processed(AlignedVector<T>* bufferPtr)
 {
     /* Returns whether the specified buffer has been processed */
     return _is_buffer_processed(get_ring_index(bufferPtr));
@@ -661,6 +698,150 @@ bool RingBuffer<T>::is_buffer_processed(uint8_t* bufferPtr)
     return _is_buffer_processed(get_ring_index(bufferPtr));
 }
 
+template <typename T>
+void RingBuffer<T>::spsc_reset()
+{
+    /* Empties the ring for a new producer and consumer.
+    Neither side may be running. */
+    this->_slotsProduced.store(0, std::memory_order_relaxed);
+    this->_slotsConsumed.store(0, std::memory_order_relaxed);
+    for (std::atomic<uint64_t>& staged: this->_slotsStaged)
+    {
+        staged.store(0, std::memory_order_relaxed);
+    }
+}
+
+template <typename T>
+void RingBuffer<T>::spsc_set_stages(uint8_t numStages)
+{
+    /* Puts numStages processing stages between the producer and
+    the consumer, each of which sees every slot in order and may
+    run on its own thread.  Nothing may be running. */
+    if (numStages > RING_BUFFER_MAX_STAGES) throw TOO_MANY_STAGES;
+    this->_numStages = numStages;
+    spsc_reset();
+}
+
+template <typename T>
+uint8_t RingBuffer<T>::spsc_stages()
+{
+    return this->_numStages;
+}
+
+template <typename T>
+inline std::atomic<uint64_t>& RingBuffer<T>::_upstream(uint8_t stage)
+{
+    /* The count a stage follows; stage spsc_stages() is the consumer */
+    return stage ? this->_slotsStaged[stage - 1] : this->_slotsProduced;
+}
+
+template <typename T>
+T* RingBuffer<T>::_acquire_from(
+        std::atomic<uint64_t>& upstream,
+        std::atomic<uint64_t>& cursor,
+        uint32_t* length
+    )
+{
+    /* Blocks until upstream has passed cursor and returns the
+    slot at cursor, or returns nullptr once upstream is closed
+    and drained */
+    uint64_t position(cursor.load(std::memory_order_relaxed) & ~SPSC_CLOSED);
+    uint64_t passed(upstream.load(std::memory_order_acquire));
+    while ((passed & ~SPSC_CLOSED) == position)
+    {
+        if (passed & SPSC_CLOSED) return nullptr;
+        upstream.wait(passed, std::memory_order_acquire);
+        passed = upstream.load(std::memory_order_acquire);
+    }
+    *length = this->_slotLengths[position % this->ringLength];
+    return &(this->ring[position % this->ringLength][0]);
+}
+
+template <typename T>
+T* RingBuffer<T>::stage_acquire(uint8_t stage, uint32_t* length)
+{
+    /* Stage side.  Blocks until the stage before has finished
+    with the next slot and returns it, or returns nullptr once
+    the stream has ended, passing the end along. */
+    T* slot(_acquire_from(_upstream(stage), this->_slotsStaged[stage], length));
+    if (!slot)
+    {
+        this->_slotsStaged[stage].fetch_or(SPSC_CLOSED, std::memory_order_release);
+        this->_slotsStaged[stage].notify_all();
+    }
+    return slot;
+}
+
+template <typename T>
+void RingBuffer<T>::stage_release(uint8_t stage)
+{
+    /* Stage side.  Passes the slot from stage_acquire() on to the
+    next stage, or to the consumer from the last one. */
+    this->_slotsStaged[stage].fetch_add(1, std::memory_order_release);
+    this->_slotsStaged[stage].notify_all();
+}
+
+template <typename T>
+T* RingBuffer<T>::spsc_acquire_write()
+{
+    /* Producer side.  Blocks until a slot is free and returns it,
+    or returns nullptr once the ring has been closed. */
+    uint64_t produced(this->_slotsProduced.load(std::memory_order_relaxed));
+    uint64_t consumed(this->_slotsConsumed.load(std::memory_order_acquire));
+    while (
+            !((produced | consumed) & SPSC_CLOSED)
+            && ((produced - consumed) >= this->ringLength)
+        )
+    {
+        this->_slotsConsumed.wait(consumed, std::memory_order_acquire);
+        consumed = this->_slotsConsumed.load(std::memory_order_acquire);
+    }
+    if ((produced | consumed) & SPSC_CLOSED) return nullptr;
+    return &(this->ring[produced % this->ringLength][0]);
+}
+
+template <typename T>
+void RingBuffer<T>::spsc_commit_write(uint32_t length)
+{
+    /* Producer side.  Publishes the slot from spsc_acquire_write()
+    holding length samples.  The release makes the slot contents
+    visible to the consumer no later than the new count. */
+    uint64_t produced(this->_slotsProduced.load(std::memory_order_relaxed));
+    this->_slotLengths[(produced & ~SPSC_CLOSED) % this->ringLength] = length;
+    this->_slotsProduced.fetch_add(1, std::memory_order_release);
+    this->_slotsProduced.notify_one();
+}
+
+template <typename T>
+void RingBuffer<T>::spsc_close()
+{
+    /* Ends the stream from either side.  Stages and the consumer
+    still drain filled slots; a producer waiting for room gives up.
+    Setting a flag bit in both counts wakes whichever side waits. */
+    this->_slotsProduced.fetch_or(SPSC_CLOSED, std::memory_order_release);
+    this->_slotsConsumed.fetch_or(SPSC_CLOSED, std::memory_order_release);
+    this->_slotsProduced.notify_all();
+    this->_slotsConsumed.notify_all();
+}
+
+template <typename T>
+T* RingBuffer<T>::spsc_acquire_read(uint32_t* length)
+{
+    /* Consumer side.  Blocks until a slot is filled, and has been
+    through every stage, and returns it, or returns nullptr once
+    the ring is closed and drained. */
+    return _acquire_from(_upstream(this->_numStages), this->_slotsConsumed, length);
+}
+
+template <typename T>
+void RingBuffer<T>::spsc_release_read()
+{
+    /* Consumer side.  Hands the slot from spsc_acquire_read()
+    back to the producer. */
+    this->_slotsConsumed.fetch_add(1, std::memory_order_release);
+    this->_slotsConsumed.notify_one();
+}
+
 template class Buffer::RingBuffer<int8_t>;
 template class Buffer::RingBuffer<uint8_t>;
 template class Buffer::RingBuffer<int16_t>;
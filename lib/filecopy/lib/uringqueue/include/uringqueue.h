@@ -0,0 +1,111 @@
+#ifndef URINGQUEUE_H
+#define URINGQUEUE_H
+
+#include <algorithm>
+#include <bitset>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <cerrno>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+enum uringqueue_err
+{
+    URING_NOT_INITIALIZED = 160,
+    URING_QUEUE_FULL = 161,
+    URING_ENTER_FAILED = 162,
+};
+
+struct UringCompletion
+{
+    uint64_t userData;
+    int32_t result;
+};
+
+class UringQueue
+{
+    /* Minimal io_uring submission/completion queue
+    driven directly through the system calls */
+protected:
+    int _ringFd;
+    unsigned _depth, _inFlight, _unsubmitted;
+
+    void *_sqRing, *_cqRing;
+    size_t _sqRingSize, _cqRingSize, _sqesSize;
+
+    unsigned
+        *_sqHead, *_sqTail, *_sqMask, *_sqArray,
+        *_cqHead, *_cqTail, *_cqMask;
+
+    struct io_uring_sqe* _sqes;
+    struct io_uring_cqe* _cqes;
+
+    /* Opcodes the kernel reported it supports */
+    std::bitset<256> _supportedOps;
+    void _probe();
+
+    struct io_uring_sqe* _get_sqe();
+    void _commit_sqe();
+    void _prep_rw(
+            uint8_t opcode,
+            int fd,
+            void* data,
+            unsigned numBytes,
+            uint64_t offset,
+            uint64_t userData
+        );
+    int _enter(unsigned toSubmit, unsigned minComplete, unsigned flags);
+
+public:
+    UringQueue();
+    UringQueue(const UringQueue& obj);
+    ~UringQueue();
+
+    bool setup(unsigned depth);
+    void teardown();
+    bool ready();
+
+    unsigned depth();
+    unsigned in_flight();
+    unsigned available();
+    bool supports(uint8_t opcode);
+
+    void prep_read(
+            int fd,
+            void* data,
+            unsigned numBytes,
+            uint64_t offset,
+            uint64_t userData
+        );
+    void prep_write(
+            int fd,
+            void* data,
+            unsigned numBytes,
+            uint64_t offset,
+            uint64_t userData
+        );
+
+    void prep_openat(
+            int dirFd,
+            const char* path,
+            int flags,
+            mode_t mode,
+            uint64_t userData
+        );
+    void prep_close(int fd, uint64_t userData);
+
+    int submit();
+    unsigned wait(
+            UringCompletion* completions,
+            unsigned maxCompletions,
+            unsigned minCompletions = 1
+        );
+};
+
+#endif
@@ -0,0 +1,378 @@
+#include "uringqueue.h"
+
+
+UringQueue::UringQueue() :
+_ringFd(-1),
+_depth(0),
+_inFlight(0),
+_unsubmitted(0),
+_sqRing(nullptr),
+_cqRing(nullptr),
+_sqRingSize(0),
+_cqRingSize(0),
+_sqesSize(0),
+_sqes(nullptr),
+_cqes(nullptr)
+{
+}
+
+UringQueue::UringQueue(const UringQueue& obj) :
+UringQueue()
+{
+    /* Rings are never shared; a copy must call setup() itself */
+}
+
+UringQueue::~UringQueue()
+{
+    teardown();
+}
+
+bool UringQueue::setup(unsigned depth)
+{
+    /* Creates the rings and maps them into this process.
+    Returns false if io_uring is unavailable so callers
+    can fall back to synchronous I/O. */
+    struct io_uring_params params;
+    bool singleMap;
+
+    teardown();
+    std::memset(&params, 0, sizeof(params));
+
+    this->_ringFd = syscall(__NR_io_uring_setup, depth, &params);
+    if (this->_ringFd < 0)
+    {
+        return false;
+    }
+
+    this->_sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    this->_cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    singleMap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (singleMap)
+    {
+        this->_sqRingSize = std::max(this->_sqRingSize, this->_cqRingSize);
+        this->_cqRingSize = this->_sqRingSize;
+    }
+
+    this->_sqRing = mmap(
+            nullptr, this->_sqRingSize,
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            this->_ringFd, IORING_OFF_SQ_RING
+        );
+    if (this->_sqRing == MAP_FAILED)
+    {
+        this->_sqRing = nullptr;
+        teardown();
+        return false;
+    }
+
+    if (singleMap)
+    {
+        this->_cqRing = this->_sqRing;
+    }
+    else
+    {
+        this->_cqRing = mmap(
+                nullptr, this->_cqRingSize,
+                PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                this->_ringFd, IORING_OFF_CQ_RING
+            );
+        if (this->_cqRing == MAP_FAILED)
+        {
+            this->_cqRing = nullptr;
+            teardown();
+            return false;
+        }
+    }
+
+    this->_sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+    this->_sqes = static_cast<struct io_uring_sqe*>(mmap(
+            nullptr, this->_sqesSize,
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            this->_ringFd, IORING_OFF_SQES
+        ));
+    if (this->_sqes == MAP_FAILED)
+    {
+        this->_sqes = nullptr;
+        teardown();
+        return false;
+    }
+
+    char* sq = static_cast<char*>(this->_sqRing);
+    char* cq = static_cast<char*>(this->_cqRing);
+    this->_sqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    this->_sqTail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    this->_sqMask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    this->_sqArray = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    this->_cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    this->_cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    this->_cqMask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    this->_cqes = reinterpret_cast<struct io_uring_cqe*>(cq + params.cq_off.cqes);
+
+    /* Never queue more than the submission ring holds,
+    so the completion ring (at least as deep) cannot overflow */
+    this->_depth = params.sq_entries;
+    this->_inFlight = 0;
+    this->_unsubmitted = 0;
+    _probe();
+
+    return true;
+}
+
+void UringQueue::_probe()
+{
+    /* Asks the kernel which opcodes it supports.  Kernels before
+    5.6 cannot be probed, but they have none of the opcodes past
+    the plain reads and writes either, so only those are assumed. */
+    std::vector<uint8_t> buffer(
+            sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op)
+        );
+    struct io_uring_probe* probe = reinterpret_cast<struct io_uring_probe*>(buffer.data());
+
+    this->_supportedOps.reset();
+    if (syscall(__NR_io_uring_register, this->_ringFd, IORING_REGISTER_PROBE, probe, 256) >= 0)
+    {
+        for (unsigned i(0); i < probe->ops_len; ++i)
+        {
+            if (probe->ops[i].flags & IO_URING_OP_SUPPORTED)
+            {
+                this->_supportedOps.set(probe->ops[i].op);
+            }
+        }
+    }
+    else
+    {
+        this->_supportedOps.set(IORING_OP_READV);
+        this->_supportedOps.set(IORING_OP_WRITEV);
+        this->_supportedOps.set(IORING_OP_READ_FIXED);
+        this->_supportedOps.set(IORING_OP_WRITE_FIXED);
+    }
+}
+
+bool UringQueue::supports(uint8_t opcode)
+{
+    /* Whether the kernel can run opcode; false before setup() */
+    return ready() && this->_supportedOps.test(opcode);
+}
+
+void UringQueue::teardown()
+{
+    if (this->_sqes)
+    {
+        munmap(this->_sqes, this->_sqesSize);
+        this->_sqes = nullptr;
+    }
+    if (this->_cqRing && (this->_cqRing != this->_sqRing))
+    {
+        munmap(this->_cqRing, this->_cqRingSize);
+    }
+    this->_cqRing = nullptr;
+    if (this->_sqRing)
+    {
+        munmap(this->_sqRing, this->_sqRingSize);
+        this->_sqRing = nullptr;
+    }
+    if (this->_ringFd >= 0)
+    {
+        ::close(this->_ringFd);
+        this->_ringFd = -1;
+    }
+    this->_supportedOps.reset();
+    this->_depth = 0;
+    this->_inFlight = 0;
+    this->_unsubmitted = 0;
+}
+
+bool UringQueue::ready()
+{
+    return (this->_ringFd >= 0);
+}
+
+unsigned UringQueue::depth()
+{
+    return this->_depth;
+}
+
+unsigned UringQueue::in_flight()
+{
+    /* Operations queued or submitted but not yet reaped */
+    return this->_inFlight;
+}
+
+unsigned UringQueue::available()
+{
+    /* Number of operations that can still be queued */
+    return this->_depth - this->_inFlight;
+}
+
+struct io_uring_sqe* UringQueue::_get_sqe()
+{
+    /* Claims and clears the next free submission entry */
+    #if _DEBUG
+    if (!ready()) throw URING_NOT_INITIALIZED;
+    #endif
+
+    if (!available())
+    {
+        throw URING_QUEUE_FULL;
+    }
+
+    unsigned index = *(this->_sqTail) & *(this->_sqMask);
+    struct io_uring_sqe* sqe = &(this->_sqes[index]);
+    std::memset(sqe, 0, sizeof(struct io_uring_sqe));
+    this->_sqArray[index] = index;
+    return sqe;
+}
+
+void UringQueue::_commit_sqe()
+{
+    /* Publishes the claimed entry; the kernel
+    may read it as soon as the tail moves */
+    __atomic_store_n(this->_sqTail, *(this->_sqTail) + 1, __ATOMIC_RELEASE);
+    ++this->_inFlight;
+    ++this->_unsubmitted;
+}
+
+void UringQueue::_prep_rw(
+        uint8_t opcode,
+        int fd,
+        void* data,
+        unsigned numBytes,
+        uint64_t offset,
+        uint64_t userData
+    )
+{
+    struct io_uring_sqe* sqe = _get_sqe();
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uint64_t>(data);
+    sqe->len = numBytes;
+    sqe->off = offset;
+    sqe->user_data = userData;
+    _commit_sqe();
+}
+
+void UringQueue::prep_read(
+        int fd,
+        void* data,
+        unsigned numBytes,
+        uint64_t offset,
+        uint64_t userData
+    )
+{
+    /* Queues a positional read into data */
+    _prep_rw(IORING_OP_READ, fd, data, numBytes, offset, userData);
+}
+
+void UringQueue::prep_write(
+        int fd,
+        void* data,
+        unsigned numBytes,
+        uint64_t offset,
+        uint64_t userData
+    )
+{
+    /* Queues a positional write from data */
+    _prep_rw(IORING_OP_WRITE, fd, data, numBytes, offset, userData);
+}
+
+void UringQueue::prep_openat(
+        int dirFd,
+        const char* path,
+        int flags,
+        mode_t mode,
+        uint64_t userData
+    )
+{
+    /* Queues an open of path relative to dirFd; the completion
+    result is the new descriptor.  path must outlive the request. */
+    struct io_uring_sqe* sqe = _get_sqe();
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = dirFd;
+    sqe->addr = reinterpret_cast<uint64_t>(path);
+    sqe->len = mode;
+    sqe->open_flags = flags;
+    sqe->user_data = userData;
+    _commit_sqe();
+}
+
+void UringQueue::prep_close(int fd, uint64_t userData)
+{
+    /* Queues a close of fd */
+    struct io_uring_sqe* sqe = _get_sqe();
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = fd;
+    sqe->user_data = userData;
+    _commit_sqe();
+}
+
+int UringQueue::_enter(unsigned toSubmit, unsigned minComplete, unsigned flags)
+{
+    int numSubmitted;
+    do
+    {
+        numSubmitted = syscall(
+                __NR_io_uring_enter,
+                this->_ringFd,
+                toSubmit,
+                minComplete,
+                flags,
+                nullptr,
+                0
+            );
+    } while ((numSubmitted < 0) && (errno == EINTR));
+
+    if (numSubmitted < 0)
+    {
+        throw URING_ENTER_FAILED;
+    }
+
+    this->_unsubmitted -= numSubmitted;
+    return numSubmitted;
+}
+
+int UringQueue::submit()
+{
+    /* Hands queued entries to the kernel without waiting */
+    if (!this->_unsubmitted) return 0;
+    return _enter(this->_unsubmitted, 0, 0);
+}
+
+unsigned UringQueue::wait(
+        UringCompletion* completions,
+        unsigned maxCompletions,
+        unsigned minCompletions
+    )
+{
+    /* Submits anything queued, blocks until at least
+    minCompletions are ready, then reaps up to maxCompletions */
+    unsigned head, tail, numReaped(0);
+
+    head = *(this->_cqHead);
+    tail = __atomic_load_n(this->_cqTail, __ATOMIC_ACQUIRE);
+    minCompletions = std::min(minCompletions, this->_inFlight);
+
+    if (this->_unsubmitted || ((tail - head) < minCompletions))
+    {
+        _enter(
+                this->_unsubmitted,
+                ((tail - head) < minCompletions) ? minCompletions : 0,
+                IORING_ENTER_GETEVENTS
+            );
+        tail = __atomic_load_n(this->_cqTail, __ATOMIC_ACQUIRE);
+    }
+
+    while ((head != tail) && (numReaped < maxCompletions))
+    {
+        struct io_uring_cqe* cqe = &(this->_cqes[head & *(this->_cqMask)]);
+        completions[numReaped].userData = cqe->user_data;
+        completions[numReaped].result = cqe->res;
+        ++numReaped;
+        ++head;
+    }
+
+    /* Release the reaped entries back to the kernel */
+    __atomic_store_n(this->_cqHead, head, __ATOMIC_RELEASE);
+    this->_inFlight -= numReaped;
+
+    return numReaped;
+}
@@ -1,14 +1,257 @@
 #include "filecopy.h"
 
+/* Set while a thread reads from a source mapping, so a SIGBUS
+from a truncated source unwinds to the read instead of killing
+the process.  Any other SIGBUS goes to the handler that was
+installed before ours. */
+static thread_local sigjmp_buf* sigbusJump = nullptr;
+static std::once_flag sigbusHandlerInstalled;
+static struct sigaction previousSigbusAction;
+
+static void sigbus_handler(int signum, siginfo_t* info, void* context)
+{
+    if (sigbusJump)
+    {
+        siglongjmp(*sigbusJump, 1);
+    }
+    if (previousSigbusAction.sa_flags & SA_SIGINFO)
+    {
+        previousSigbusAction.sa_sigaction(signum, info, context);
+        return;
+    }
+    if (previousSigbusAction.sa_handler == SIG_IGN)
+    {
+        return;
+    }
+    if (previousSigbusAction.sa_handler != SIG_DFL)
+    {
+        previousSigbusAction.sa_handler(signum);
+        return;
+    }
+    signal(SIGBUS, SIG_DFL);
+    raise(SIGBUS);
+}
+
+static bool is_zero_block_portable(const char* data, size_t numBytes)
+{
+    uint64_t word, accumulator(0);
+    size_t i(0);
+    for (; (i + sizeof(word)) <= numBytes; i += sizeof(word))
+    {
+        std::memcpy(&word, data + i, sizeof(word));
+        accumulator |= word;
+    }
+    for (; i < numBytes; ++i)
+    {
+        accumulator |= static_cast<uint8_t>(data[i]);
+    }
+    return !accumulator;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2")))
+static bool is_zero_block_avx2(const char* data, size_t numBytes)
+{
+    /* ORs 128 bytes per step and tests the result once */
+    size_t i(0);
+    for (; (i + 128) <= numBytes; i += 128)
+    {
+        const __m256i* block = reinterpret_cast<const __m256i*>(data + i);
+        __m256i accumulator = _mm256_or_si256(
+                _mm256_or_si256(
+                        _mm256_loadu_si256(block),
+                        _mm256_loadu_si256(block + 1)
+                    ),
+                _mm256_or_si256(
+                        _mm256_loadu_si256(block + 2),
+                        _mm256_loadu_si256(block + 3)
+                    )
+            );
+        if (!_mm256_testz_si256(accumulator, accumulator)) return false;
+    }
+    return is_zero_block_portable(data + i, numBytes - i);
+}
+
+static bool is_zero_block_sse2(const char* data, size_t numBytes)
+{
+    size_t i(0);
+    const __m128i zero = _mm_setzero_si128();
+    for (; (i + 64) <= numBytes; i += 64)
+    {
+        const __m128i* block = reinterpret_cast<const __m128i*>(data + i);
+        __m128i accumulator = _mm_or_si128(
+                _mm_or_si128(_mm_loadu_si128(block), _mm_loadu_si128(block + 1)),
+                _mm_or_si128(_mm_loadu_si128(block + 2), _mm_loadu_si128(block + 3))
+            );
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(accumulator, zero)) != 0xFFFF)
+        {
+            return false;
+        }
+    }
+    return is_zero_block_portable(data + i, numBytes - i);
+}
+#endif
+
+static bool is_zero_block(const char* data, size_t numBytes)
+{
+    /* Whether a block is entirely zero, using the widest
+    vector unit the CPU offers */
+    #if defined(__x86_64__)
+    static const bool hasAvx2 = __builtin_cpu_supports("avx2");
+    return (
+            hasAvx2
+            ? is_zero_block_avx2(data, numBytes)
+            : is_zero_block_sse2(data, numBytes)
+        );
+    #else
+    return is_zero_block_portable(data, numBytes);
+    #endif
+}
+
+static const uint32_t* crc32c_table()
+{
+    /* Reflected CRC-32C (Castagnoli) table, built on first use */
+    static uint32_t table[256];
+    static std::once_flag built;
+    std::call_once(built, []()
+    {
+        for (uint32_t i(0); i < 256; ++i)
+        {
+            uint32_t crc(i);
+            for (int bit(0); bit < 8; ++bit)
+            {
+                crc = (crc >> 1) ^ ((crc & 1) ? 0x82F63B78 : 0);
+            }
+            table[i] = crc;
+        }
+    });
+    return table;
+}
+
+static uint32_t crc32c_portable(uint32_t crc, const char* data, size_t numBytes)
+{
+    const uint32_t* table = crc32c_table();
+    for (size_t i(0); i < numBytes; ++i)
+    {
+        crc = table[(crc ^ static_cast<uint8_t>(data[i])) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const char* data, size_t numBytes)
+{
+    /* Folds in eight bytes per instruction */
+    uint64_t word, state(crc);
+    size_t i(0);
+    for (; (i + sizeof(word)) <= numBytes; i += sizeof(word))
+    {
+        std::memcpy(&word, data + i, sizeof(word));
+        state = _mm_crc32_u64(state, word);
+    }
+    crc = static_cast<uint32_t>(state);
+    for (; i < numBytes; ++i)
+    {
+        crc = _mm_crc32_u8(crc, static_cast<uint8_t>(data[i]));
+    }
+    return crc;
+}
+#endif
+
+static uint32_t crc32c(uint32_t crc, const char* data, size_t numBytes)
+{
+    /* Continues a CRC-32C over more data, in hardware when the
+    CPU has SSE4.2.  Start from 0. */
+    crc = ~crc;
+    #if defined(__x86_64__)
+    static const bool hasSse42 = __builtin_cpu_supports("sse4.2");
+    crc = (
+            hasSse42
+            ? crc32c_sse42(crc, data, numBytes)
+            : crc32c_portable(crc, data, numBytes)
+        );
+    #else
+    crc = crc32c_portable(crc, data, numBytes);
+    #endif
+    return ~crc;
+}
+
+/* Geometry learned for each source and destination device pair,
+shared by every copier in the process */
+static std::map<std::pair<dev_t, dev_t>, BufferGeometry> learnedGeometry;
+static std::mutex learnedGeometryMutex;
+
+static void install_sigbus_handler()
+{
+    struct sigaction action;
+    std::memset(&action, 0, sizeof(action));
+    action.sa_sigaction = sigbus_handler;
+    action.sa_flags = SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGBUS, &action, &previousSigbusAction);
+}
 
 FileCopy::FileCopy() :
 _firstWritten(false),
 _overwrite(false),
+_reflink(false),
+_direct(false),
+_threaded(false),
+_sparse(false),
+_preallocate(true),
+_adaptive(false),
+_ranged(false),
+_resume(false),
 _sourceSizeInBytes(0),
 _destSizeInBytes(0),
 _numBytesReadToBuffer(0),
 _numBytesWrittenFromBuffer(0),
-_buff(RING_BUFFER_CHUNKSIZE, 4),
+_numBytesCloned(0),
+_sourceMtime(0),
+_destMtime(0),
+_engine(ENGINE_STREAM),
+_kernelMethod(KERNEL_COPY_FILE_RANGE),
+_skipPolicy(SKIP_EXISTS),
+_inFd(-1),
+_outFd(-1),
+_pipeFds{-1, -1},
+_sourceDataEnd(0),
+_sparseTail(0),
+_extentHint(0),
+_cachePolicy(CACHE_KEEP),
+_advisedOffset(0),
+_releasedOffset(0),
+_smallFileThreshold(SMALL_FILE_THRESHOLD),
+_readLatency{0, 0, 0},
+_writeLatency{0, 0, 0},
+_devices(0, 0),
+_configuredGeometry{RING_BUFFER_CHUNKSIZE, RING_BUFFER_DEPTH},
+_geometryLearned(false),
+_queueDepth(4),
+_uringInFlight(0),
+_uringSourceEnded(false),
+_uringReadOffset(0),
+_uringHashOffset(0),
+_uringSourceEnd(0),
+_uringDataEnd(0),
+_uring(nullptr),
+_deferredCloses(nullptr),
+_sourceMap(nullptr),
+_mapOffset(0),
+_rangeOffset(0),
+_rangeLength(0),
+_digestBlockSize(0),
+_digestOffset(0),
+_digestFrom(0),
+_digestCrc(0),
+_mirrorLag(MIRROR_LAG_SLOTS),
+_checkpointInterval(RESUME_CHECKPOINT_INTERVAL),
+_checkpointOffset(0),
+_positionalOffset(0),
+_hashStarted(false),
+_hasher(nullptr),
+_buff(RING_BUFFER_CHUNKSIZE, RING_BUFFER_DEPTH),
 started(false)
 {
 }
@@ -16,18 +259,291 @@ started(false)
 FileCopy::FileCopy(const FileCopy& obj) :
 _firstWritten(obj._firstWritten),
 _overwrite(obj._overwrite),
+_reflink(obj._reflink),
+_direct(obj._direct),
+_threaded(obj._threaded),
+_sparse(obj._sparse),
+_preallocate(obj._preallocate),
+_adaptive(obj._adaptive),
+_ranged(obj._ranged),
+_resume(obj._resume),
 _sourceSizeInBytes(obj._sourceSizeInBytes),
 _destSizeInBytes(obj._destSizeInBytes),
 _numBytesReadToBuffer(obj._numBytesReadToBuffer),
 _numBytesWrittenFromBuffer(obj._numBytesWrittenFromBuffer),
+_numBytesCloned(obj._numBytesCloned),
+_sourceMtime(obj._sourceMtime),
+_destMtime(obj._destMtime),
+_engine(obj._engine),
+_kernelMethod(KERNEL_COPY_FILE_RANGE),
+_skipPolicy(obj._skipPolicy),
+_inFd(-1),
+_outFd(-1),
+_pipeFds{-1, -1},
+_sourceDataEnd(0),
+_sparseTail(0),
+_extentHint(obj._extentHint),
+_cachePolicy(obj._cachePolicy),
+_advisedOffset(0),
+_releasedOffset(0),
+_smallFileThreshold(obj._smallFileThreshold),
+_readLatency{0, 0, 0},
+_writeLatency{0, 0, 0},
+_devices(0, 0),
+_configuredGeometry(obj._configuredGeometry),
+_geometryLearned(obj._geometryLearned),
+_queueDepth(obj._queueDepth),
+_uringInFlight(0),
+_uringSourceEnded(false),
+_uringReadOffset(0),
+_uringHashOffset(0),
+_uringSourceEnd(0),
+_uringDataEnd(0),
+_uring(nullptr),
+_deferredCloses(nullptr),
+_sourceMap(nullptr),
+_mapOffset(0),
+_rangeOffset(obj._rangeOffset),
+_rangeLength(obj._rangeLength),
+_digestBlockSize(obj._digestBlockSize),
+_digestOffset(0),
+_digestFrom(0),
+_digestCrc(0),
+_mirrorLag(obj._mirrorLag),
+_checkpointInterval(obj._checkpointInterval),
+_checkpointOffset(0),
+_positionalOffset(obj._rangeOffset),
+_hashStarted(false),
+_hasher(nullptr),
 _buff(obj._buff.bufferLength, obj._buff.ringLength),
 started(obj.started)
 {
+    set_hash_algorithm(obj._hashAlgorithm.c_str());
 }
 
 FileCopy::~FileCopy()
 {
     close();
+    _close_fd(&(this->_pipeFds[0]));
+    _close_fd(&(this->_pipeFds[1]));
+    delete this->_hasher;
+}
+
+void FileCopy::set_engine(copy_engine engine)
+{
+    /* Selects the transfer engine.
+    Must be set before the source and destination are opened. */
+    this->_engine = engine;
+}
+
+copy_engine FileCopy::get_engine()
+{
+    return this->_engine;
+}
+
+void FileCopy::set_reflink(bool reflink)
+{
+    /* Share extents with the source instead of copying data
+    when both files are on the same filesystem */
+    this->_reflink = reflink;
+}
+
+void FileCopy::set_direct(bool direct)
+{
+    /* Bypass the page cache with O_DIRECT.
+    Must be set before the source and destination are opened. */
+    this->_direct = direct;
+}
+
+void FileCopy::set_threaded(bool threaded)
+{
+    /* Read on a second thread while the calling thread writes */
+    this->_threaded = threaded;
+}
+
+void FileCopy::set_sparse(bool sparse)
+{
+    /* Skip source holes and zero blocks, leaving holes in the
+    destination.  Sparse copies always go through the ring buffer
+    on the calling thread, whichever engine is selected. */
+    this->_sparse = sparse;
+}
+
+void FileCopy::set_preallocate(bool preallocate)
+{
+    /* Reserve the whole destination before the first write so
+    it is laid out in as few extents as possible */
+    this->_preallocate = preallocate;
+}
+
+void FileCopy::set_extent_hint(size_t numBytes)
+{
+    /* Extent size hint applied to destinations of at least
+    EXTENT_HINT_MIN_FILESIZE.  Filesystems without hint support
+    ignore it. */
+    this->_extentHint = numBytes;
+}
+
+void FileCopy::set_cache_policy(cache_policy policy)
+{
+    /* How the transfer advises the kernel about the page cache.
+    Any policy but CACHE_KEEP moves the stream engine onto
+    descriptors, since advice needs one. */
+    this->_cachePolicy = policy;
+}
+
+void FileCopy::set_small_file_threshold(size_t numBytes)
+{
+    /* Sources up to this size are moved with a single read and
+    write instead of through the ring.  Never more than one ring
+    slot; 0 turns the fast path off. */
+    this->_smallFileThreshold = numBytes;
+}
+
+void FileCopy::set_chunk_size(size_t numBytes)
+{
+    /* Size of one ring slot, rounded up to the O_DIRECT alignment.
+    Reallocates the ring, so only call it between transfers. */
+    /* The ring keeps slot lengths in an int */
+    numBytes = std::min(numBytes, static_cast<size_t>(1) << 30);
+    numBytes = std::max(numBytes, static_cast<size_t>(RING_BUFFER_ALIGNMENT));
+    numBytes = (
+            (numBytes + RING_BUFFER_ALIGNMENT - 1)
+            / RING_BUFFER_ALIGNMENT
+            * RING_BUFFER_ALIGNMENT
+        );
+    if (numBytes != static_cast<size_t>(this->_buff.bufferLength))
+    {
+        this->_buff.set_size(numBytes, this->_buff.ringLength);
+    }
+}
+
+void FileCopy::set_ring_depth(uint8_t depth)
+{
+    /* Number of ring slots.  At least two, and never fewer than
+    the io_uring queue depth.  Only call it between transfers. */
+    depth = std::max(depth, uint8_t(2));
+    depth = std::max(depth, static_cast<uint8_t>(this->_queueDepth));
+    if (depth != this->_buff.ringLength)
+    {
+        this->_buff.set_size(this->_buff.bufferLength, depth);
+    }
+}
+
+void FileCopy::set_adaptive_geometry(bool adaptive)
+{
+    /* Times every chunk and tunes chunk size and ring depth for
+    each pair of devices, applying what was learned from earlier
+    files at the start of the next one.  Only descriptor reads
+    and writes are timed, so the stream engine moves onto them. */
+    this->_adaptive = adaptive;
+}
+
+void FileCopy::set_range(size_t offset, size_t numBytes)
+{
+    /* Copies only this byte range of the source into the same
+    range of an existing destination, which is not truncated.
+    Ranges always use the positional engine and are not hashed,
+    since no copier sees the whole file.  Cleared by reset(). */
+    this->_ranged = true;
+    this->_rangeOffset = offset;
+    this->_rangeLength = numBytes;
+    this->_positionalOffset = offset;
+}
+
+void FileCopy::set_resume(bool resume)
+{
+    /* Continues a partial destination instead of skipping or
+    truncating it, as long as overwriting is off.  A destination
+    that is continued uses the positional engine, and a hashed
+    copy on it saves its hash state beside the destination every
+    checkpoint interval so the source prefix need not be read
+    again.  Fresh copies keep their own engine. */
+    this->_resume = resume;
+}
+
+void FileCopy::set_checkpoint_interval(size_t numBytes)
+{
+    /* Bytes copied between hash checkpoints; 0 turns them off */
+    this->_checkpointInterval = numBytes;
+}
+
+void FileCopy::set_skip_policy(skip_policy policy)
+{
+    /* How an existing destination is judged to match the source
+    when overwriting is off.  One that does not match is copied
+    again, or continued when resuming. */
+    this->_skipPolicy = policy;
+}
+
+void FileCopy::set_block_digest_size(size_t numBytes)
+{
+    /* Records a digest of every block of this many source bytes
+    as the data passes through, so a damaged destination can be
+    repaired block by block.  0 turns the digests off.  The kernel
+    engine and reflinks never see the data and record none. */
+    this->_digestBlockSize = numBytes;
+}
+
+void FileCopy::set_mirror_lag(uint8_t numSlots)
+{
+    /* How many chunks the fastest destination of a mirrored copy
+    may get ahead of the slowest before it waits.  A ring shorter
+    than this grows for a source with more chunks than it holds,
+    and is put back afterwards. */
+    this->_mirrorLag = std::max(numSlots, static_cast<uint8_t>(1));
+}
+
+BufferGeometry FileCopy::get_geometry()
+{
+    return BufferGeometry{
+            static_cast<size_t>(this->_buff.bytesPerBuffer),
+            this->_buff.ringLength
+        };
+}
+
+void FileCopy::set_queue_depth(unsigned depth)
+{
+    /* Number of ring buffer slots the io_uring engine keeps in
+    flight at once.  The ring grows to match if it is shorter. */
+    #if _DEBUG
+    if (depth < 1) throw std::out_of_range("Queue depth must be >= 1");
+    #endif
+    depth = std::min(depth, unsigned(std::numeric_limits<uint8_t>::max()));
+    if (depth > this->_buff.ringLength)
+    {
+        this->_buff.set_size(this->_buff.bufferLength, depth);
+    }
+    this->_queueDepth = depth;
+}
+
+void FileCopy::set_hash_algorithm(const char* algo)
+{
+    /* Hashes the source as it passes through the copier.
+    An empty name turns source hashing off. */
+    wrapperfactory factory;
+    delete this->_hasher;
+    this->_hasher = nullptr;
+    this->_hashAlgorithm = algo;
+    if (!this->_hashAlgorithm.empty())
+    {
+        this->_hasher = factory.create(this->_hashAlgorithm);
+    }
+}
+
+void FileCopy::set_uring(UringQueue* queue)
+{
+    /* Shares an external queue so one thread can drive
+    several copiers; nullptr makes the copier use its own */
+    this->_uring = queue;
+}
+
+void FileCopy::set_deferred_closes(std::vector<int>* fds)
+{
+    /* Hands descriptors the copier is done with to fds rather
+    than closing them, so the caller can close many at once;
+    nullptr closes them immediately again */
+    this->_deferredCloses = fds;
 }
 
 inline void FileCopy::_check_paths_not_empty()
@@ -58,248 +574,2674 @@ inline void FileCopy::_check_file_size_match()
     }
 }
 
-void FileCopy::open_source(std::filesystem::path filepath)
+inline bool FileCopy::_uses_fd()
 {
-    /* Opens source file and gets file size */
-    this->source = filepath;
-    get_source_size();
-    this->_inStream.open(this->source, std::ios::binary);
+    /* Whether the selected engine works on raw file descriptors */
+    return (
+            (this->_engine != ENGINE_STREAM)
+            || this->_direct
+            || this->_sparse
+            || (this->_cachePolicy != CACHE_KEEP)
+            || this->_adaptive
+            || this->_ranged
+            || this->_resume
+            || _small_file()
+        );
 }
 
-void FileCopy::open_source(const char* filepath)
+inline bool FileCopy::_source_open()
 {
-    /* Opens source file and gets file size */
-    this->source = filepath;
-    get_source_size();
-    this->_inStream.open(this->source, std::ios::binary);
+    return (this->_inStream.is_open() || (this->_inFd >= 0));
 }
 
-inline void FileCopy::open_dest(std::filesystem::path filepath)
+inline bool FileCopy::_dest_open()
 {
-    /* Opens new destination file */
-    this->dest = filepath;
-    if (!this->_overwrite && std::filesystem::exists(this->dest))
+    return (this->_outStream.is_open() || (this->_outFd >= 0));
+}
+
+int FileCopy::_open_fd(const char* filepath, int flags)
+{
+    /* Opens a descriptor, dropping O_DIRECT if the
+    filesystem does not support it.  The kernel engine
+    never touches the ring buffer, and ranges that start
+    off a block boundary cannot be read directly, so
+    both stay buffered. */
+    int fd(-1);
+    if (
+            this->_direct
+            && (this->_engine != ENGINE_KERNEL)
+            && !(this->_rangeOffset % RING_BUFFER_ALIGNMENT)
+        )
     {
-        get_dest_size();
-        return;
+        fd = ::open(filepath, flags | O_DIRECT, 0666);
     }
-    this->_outStream.open(this->dest, std::ios::binary);
+    if (fd < 0)
+    {
+        fd = ::open(filepath, flags, 0666);
+    }
+    return fd;
 }
 
-void FileCopy::open_dest(const char* filepath)
+void FileCopy::_open_source_fd()
 {
-    /* Opens new destination file */
-    open_dest(std::filesystem::path(filepath));
+    this->_inFd = _open_fd(this->source.c_str(), O_RDONLY);
+    if (this->_inFd < 0)
+    {
+        throw SOURCE_OPEN_FAILED;
+    }
+    if (this->_cachePolicy != CACHE_KEEP)
+    {
+        posix_fadvise(this->_inFd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
 }
 
-std::filesystem::path FileCopy::_rename_dest()
+void FileCopy::_open_dest_fd()
 {
-    #if _DEBUG
-    if (this->source.empty())
+    this->_outFd = _open_fd(
+            this->dest.c_str(),
+            O_WRONLY | O_CREAT | ((this->_ranged || this->_rangeOffset) ? 0 : O_TRUNC)
+        );
+    if (this->_outFd < 0)
     {
-        throw SOURCE_NOT_SET;
+        throw DEST_OPEN_FAILED;
+    }
+}
+
+inline void FileCopy::_close_fd(int* fd)
+{
+    if (*fd >= 0)
+    {
+        if (this->_deferredCloses)
+        {
+            this->_deferredCloses->push_back(*fd);
+        }
+        else
+        {
+            ::close(*fd);
+        }
+        *fd = -1;
+    }
+}
+
+bool FileCopy::_is_direct(int fd)
+{
+    /* Whether fd was opened, and is still, with O_DIRECT */
+    int flags(fcntl(fd, F_GETFL));
+    return (flags >= 0) && (flags & O_DIRECT);
+}
+
+size_t FileCopy::_read_fd(char* data, size_t numBytes)
+{
+    /* Reads until the buffer is full or the source ends */
+    ssize_t numBytesRead;
+    size_t total(0);
+    std::chrono::steady_clock::time_point start(_latency_start());
+    while (total < numBytes)
+    {
+        numBytesRead = ::read(this->_inFd, data + total, numBytes - total);
+        if (numBytesRead < 0)
+        {
+            if (errno == EINTR) continue;
+            throw SOURCE_READ_FAILED;
+        }
+        else if (!numBytesRead)
+        {
+            break;
+        }
+        total += numBytesRead;
+
+        /* O_DIRECT cannot read on from an unaligned offset, so
+        there an unaligned short read has to be taken as the end.
+        Otherwise read on: NFS, FUSE and signals all cut reads
+        short in the middle of a file. */
+        if ((total % RING_BUFFER_ALIGNMENT) && _is_direct(this->_inFd)) break;
+    }
+    _record_latency(&(this->_readLatency), start);
+    return total;
+}
+
+size_t FileCopy::_write_fd(char* data, size_t numBytes)
+{
+    std::chrono::steady_clock::time_point start(_latency_start());
+    size_t total(_write_fd(this->_outFd, data, numBytes));
+    _record_latency(&(this->_writeLatency), start);
+    return total;
+}
+
+size_t FileCopy::_write_fd(int fd, char* data, size_t numBytes)
+{
+    /* Writes the whole chunk.  With O_DIRECT the aligned part
+    goes first, then the flag is dropped for the unaligned tail,
+    which can only be the final chunk of the file. */
+    ssize_t numBytesWritten;
+    size_t total(0), aligned(numBytes);
+
+    if (this->_direct)
+    {
+        aligned -= numBytes % RING_BUFFER_ALIGNMENT;
+    }
+
+    while (total < numBytes)
+    {
+        if (total == aligned)
+        {
+            _clear_direct(fd);
+            aligned = numBytes;
+        }
+        numBytesWritten = ::write(
+                fd,
+                data + total,
+                aligned - total
+            );
+        if (numBytesWritten < 0)
+        {
+            if (errno == EINTR) continue;
+
+            /* Writing from a mapping whose file was truncated */
+            if ((errno == EFAULT) && _mapping_truncated(data + total)) throw SOURCE_TRUNCATED;
+
+            throw DEST_WRITE_FAILED;
+        }
+        total += numBytesWritten;
+    }
+    return total;
+}
+
+void FileCopy::_clear_direct(int fd)
+{
+    /* Drops O_DIRECT so an unaligned tail can be written */
+    int flags = fcntl(fd, F_GETFL);
+    if ((flags >= 0) && (flags & O_DIRECT))
+    {
+        fcntl(fd, F_SETFL, flags & ~O_DIRECT);
+    }
+}
+
+size_t FileCopy::_map_slot_vectors(size_t numBytes)
+{
+    /* Points one iovec at each ring slot, in ring order, covering
+    numBytes.  Returns the number of vectors used. */
+    size_t numVectors(0), length;
+
+    this->_slotVectors.resize(this->_buff.ringLength);
+    while (numBytes && (numVectors < this->_buff.ringLength))
+    {
+        length = std::min(numBytes, static_cast<size_t>(this->_buff.bytesPerBuffer));
+        this->_slotVectors[numVectors].iov_base = this->_buff.ring[numVectors].data();
+        this->_slotVectors[numVectors].iov_len = length;
+        numBytes -= length;
+        ++numVectors;
+    }
+    return numVectors;
+}
+
+size_t FileCopy::_preadv_fd(size_t numBytes, size_t offset)
+{
+    /* Reads numBytes into the start of the ring from offset,
+    picking up after short reads, which a single preadv gives
+    past 2 GiB, on NFS and FUSE and when a signal arrives.  Only
+    a read of nothing, or an unaligned one under O_DIRECT, which
+    cannot read on from there, is taken as the end of the file. */
+    ssize_t numBytesRead;
+    size_t total(0), first(0), numVectors;
+    std::chrono::steady_clock::time_point start(_latency_start());
+
+    numVectors = _map_slot_vectors(numBytes);
+
+    while (total < numBytes)
+    {
+        numBytesRead = preadv(
+                this->_inFd,
+                &(this->_slotVectors[first]),
+                numVectors - first,
+                offset + total
+            );
+        if (numBytesRead < 0)
+        {
+            if (errno == EINTR) continue;
+            throw SOURCE_READ_FAILED;
+        }
+        if (!numBytesRead) break;
+        total += numBytesRead;
+        if ((total % RING_BUFFER_ALIGNMENT) && _is_direct(this->_inFd)) break;
+
+        /* Skip the vectors that are done and trim the next one */
+        while (
+                (first < numVectors)
+                && (static_cast<size_t>(numBytesRead) >= this->_slotVectors[first].iov_len)
+            )
+        {
+            numBytesRead -= this->_slotVectors[first].iov_len;
+            ++first;
+        }
+        if (numBytesRead)
+        {
+            this->_slotVectors[first].iov_base = (
+                    static_cast<char*>(this->_slotVectors[first].iov_base)
+                    + numBytesRead
+                );
+            this->_slotVectors[first].iov_len -= numBytesRead;
+        }
+    }
+    _record_latency(&(this->_readLatency), start);
+    return total;
+}
+
+size_t FileCopy::_pwritev_fd(size_t numBytes, size_t offset)
+{
+    /* Writes numBytes from the start of the ring at offset,
+    picking up after short writes.  With O_DIRECT the unaligned
+    tail of the final batch goes out after the flag is dropped. */
+    ssize_t numBytesWritten;
+    size_t total(0), aligned(numBytes), first(0), numVectors;
+    std::chrono::steady_clock::time_point start(_latency_start());
+
+    if (this->_direct)
+    {
+        aligned -= numBytes % RING_BUFFER_ALIGNMENT;
+    }
+    numVectors = _map_slot_vectors(aligned);
+
+    while (total < aligned)
+    {
+        numBytesWritten = pwritev(
+                this->_outFd,
+                &(this->_slotVectors[first]),
+                numVectors - first,
+                offset + total
+            );
+        if (numBytesWritten < 0)
+        {
+            if (errno == EINTR) continue;
+            throw DEST_WRITE_FAILED;
+        }
+        total += numBytesWritten;
+
+        /* Skip the vectors that are done and trim the next one */
+        while (
+                (first < numVectors)
+                && (static_cast<size_t>(numBytesWritten) >= this->_slotVectors[first].iov_len)
+            )
+        {
+            numBytesWritten -= this->_slotVectors[first].iov_len;
+            ++first;
+        }
+        if (numBytesWritten)
+        {
+            this->_slotVectors[first].iov_base = (
+                    static_cast<char*>(this->_slotVectors[first].iov_base)
+                    + numBytesWritten
+                );
+            this->_slotVectors[first].iov_len -= numBytesWritten;
+        }
+    }
+
+    if (total < numBytes)
+    {
+        char* tail = (
+                reinterpret_cast<char*>(this->_buff.ring[aligned / this->_buff.bytesPerBuffer].data())
+                + (aligned % this->_buff.bytesPerBuffer)
+            );
+        _clear_direct(this->_outFd);
+        while (total < numBytes)
+        {
+            numBytesWritten = pwrite(
+                    this->_outFd,
+                    tail + (total - aligned),
+                    numBytes - total,
+                    offset + total
+                );
+            if (numBytesWritten < 0)
+            {
+                if (errno == EINTR) continue;
+                throw DEST_WRITE_FAILED;
+            }
+            total += numBytesWritten;
+        }
+    }
+
+    _record_latency(&(this->_writeLatency), start);
+    return total;
+}
+
+void FileCopy::open_source(std::filesystem::path filepath)
+{
+    /* Opens source file and gets file size */
+    open_source(filepath, -1);
+}
+
+void FileCopy::open_source(std::filesystem::path filepath, int fd)
+{
+    /* Takes over a source descriptor already opened read only,
+    as in a batch of opens, and stats it rather than the path.
+    Opens by path instead when fd is -1, or closes fd and does so
+    if this copy needs O_DIRECT or streams. */
+    this->source = filepath;
+    _stat_source(fd);
+    if ((fd >= 0) && _uses_fd() && !this->_direct)
+    {
+        this->_inFd = fd;
+        if (this->_cachePolicy != CACHE_KEEP)
+        {
+            posix_fadvise(this->_inFd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        }
+        return;
+    }
+    _close_fd(&fd);
+    if (_uses_fd())
+    {
+        _open_source_fd();
+        return;
+    }
+    this->_inStream.open(this->source, std::ios::binary);
+}
+
+void FileCopy::open_source(const char* filepath)
+{
+    /* Opens source file and gets file size */
+    open_source(std::filesystem::path(filepath));
+}
+
+void FileCopy::open_dest(std::filesystem::path filepath)
+{
+    /* Opens new destination file */
+    open_dest(filepath, -1);
+}
+
+void FileCopy::open_dest(std::filesystem::path filepath, int fd)
+{
+    /* Takes over a destination descriptor already opened write
+    only with O_CREAT but not O_TRUNC, so an existing destination
+    can still be checked and skipped through it.  It is truncated
+    once the copy goes ahead.  Opens by path as open_source() does
+    otherwise. */
+    struct stat status;
+
+    this->dest = filepath;
+    if (!this->_overwrite && !this->_ranged && _stat_dest(fd))
+    {
+        _check_existing_dest();
+        if (should_skip())
+        {
+            _close_fd(&fd);
+            return;
+        }
+    }
+    if ((fd >= 0) && _uses_fd() && !this->_direct)
+    {
+        this->_outFd = fd;
+        if (
+                !this->_ranged
+                && !this->_rangeOffset
+                && (fstat(fd, &status) == 0)
+                && status.st_size
+            )
+        {
+            ftruncate(fd, 0);
+        }
+        return;
+    }
+    _close_fd(&fd);
+    if (_uses_fd())
+    {
+        _open_dest_fd();
+        return;
+    }
+    this->_outStream.open(this->dest, std::ios::binary);
+}
+
+void FileCopy::open_dest(const char* filepath)
+{
+    /* Opens new destination file */
+    open_dest(std::filesystem::path(filepath));
+}
+
+std::filesystem::path FileCopy::_rename_dest()
+{
+    #if _DEBUG
+    if (this->source.empty())
+    {
+        throw SOURCE_NOT_SET;
+    }
+    #endif
+    this->dest.replace_filename(this->source.filename());
+}
+
+void FileCopy::open_dest()
+{
+    open_dest(std::filesystem::path(_rename_dest()));
+}
+
+void FileCopy::open_mirror(std::filesystem::path filepath)
+{
+    /* Adds another destination, written from the same reads of
+    the source.  Call after open_dest().  As with the destination,
+    an existing mirror that passes the skip policy is left alone
+    unless overwriting.  Mirrors are never resumed, so a copy being
+    resumed starts over.  Cleared by reset(). */
+    struct stat status;
+    int fd(-1);
+
+    if (
+            this->_overwrite
+            || (::stat(filepath.c_str(), &status) < 0)
+            || !_dest_matches(
+                    filepath, status.st_size,
+                    static_cast<int64_t>(status.st_mtim.tv_sec) * 1000000000
+                    + status.st_mtim.tv_nsec
+                )
+        )
+    {
+        fd = _open_fd(filepath.c_str(), O_WRONLY | O_CREAT | O_TRUNC);
+        if (fd < 0)
+        {
+            throw DEST_OPEN_FAILED;
+        }
+        if (this->_preallocate && get_source_size())
+        {
+            fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, get_source_size());
+        }
+        if (this->_rangeOffset && !this->_ranged)
+        {
+            this->_rangeOffset = 0;
+            this->_positionalOffset = 0;
+            this->_checkpointOffset = 0;
+            this->_hashStarted = false;
+        }
+    }
+
+    this->_mirrorPaths.push_back(filepath);
+    this->_mirrorFds.push_back(fd);
+    this->_mirrorBytesWritten.push_back(0);
+}
+
+size_t FileCopy::get_source_size()
+{
+    /* Get source file size */
+    if (!this->_sourceSizeInBytes)
+    {
+        this->_sourceSizeInBytes = std::filesystem::file_size(this->source);
+    }
+    return this->_sourceSizeInBytes;
+}
+
+size_t FileCopy::get_dest_size()
+{
+    /* Get destination file size */
+    #if _DEBUG
+    std::cout << "Checking dest file size" << std::endl;
+    if (started && !complete())
+    {
+        std::cerr << "Cannot get dest size; ";
+        std::cerr << "incomplete copy in progress" << std::endl;
+        return 0;
+    }
+    #endif
+    if (!this->_destSizeInBytes)
+    {
+        this->_destSizeInBytes = std::filesystem::file_size(this->dest);
+    }
+    return this->_destSizeInBytes;
+}
+
+size_t FileCopy::bytes_remaining()
+{
+    return this->_numBytesReadToBuffer - this->_numBytesWrittenFromBuffer;
+}
+
+size_t FileCopy::bytes_moved()
+{
+    /* Bytes physically written to the destination */
+    return this->_numBytesWrittenFromBuffer;
+}
+
+size_t FileCopy::mirror_bytes_moved(size_t mirror)
+{
+    /* Bytes written to a mirror, in the order they were opened */
+    return this->_mirrorBytesWritten.at(mirror);
+}
+
+size_t FileCopy::bytes_cloned()
+{
+    /* Bytes shared with the source by reflink instead of written */
+    return this->_numBytesCloned;
+}
+
+bool FileCopy::hashed()
+{
+    /* Whether the source checksum was produced during the copy */
+    return !this->_sourceChecksum.empty();
+}
+
+std::string FileCopy::get_source_checksum()
+{
+    return this->_sourceChecksum;
+}
+
+const std::vector<block_digest>& FileCopy::get_block_digests()
+{
+    /* One entry per block of the source, BLOCK_DIGEST_NONE for
+    blocks that were not recorded; empty if none were */
+    return this->_blockDigests;
+}
+
+bool FileCopy::ready()
+{
+    /* Indicates if both files are open and ready to transfer */
+    return (_source_open() && _dest_open());
+}
+
+void FileCopy::close()
+{
+    #if _DEBUG
+    std::cout << "Closing files..." << std::endl;
+    #endif
+    this->_inStream.close();
+    this->_outStream.close();
+    _unmap_source();
+    _close_fd(&(this->_inFd));
+    _extend_sparse_dest();
+    _close_fd(&(this->_outFd));
+    for (int& fd: this->_mirrorFds)
+    {
+        _close_fd(&fd);
+    }
+}
+
+bool FileCopy::complete()
+{
+    return (
+            this->started
+            && !ready()
+            && !bytes_remaining()
+            && !this->_buff.buffered()
+        );
+}
+
+void FileCopy::reset()
+{
+    close();
+    this->source = std::filesystem::path();
+    this->dest = std::filesystem::path();
+    this->started = false;
+    this->_firstWritten = false;
+    this->_sourceSizeInBytes = 0;
+    this->_destSizeInBytes = 0;
+    this->_numBytesReadToBuffer = 0;
+    this->_numBytesWrittenFromBuffer = 0;
+    this->_numBytesCloned = 0;
+    this->_sourceMtime = 0;
+    this->_destMtime = 0;
+    this->_kernelMethod = KERNEL_COPY_FILE_RANGE;
+    this->_uringInFlight = 0;
+    this->_uringSourceEnded = false;
+    this->_uringReadOffset = 0;
+    this->_uringHashOffset = 0;
+    this->_uringSourceEnd = 0;
+    this->_uringDataEnd = 0;
+    this->_uringSlots.clear();
+    this->_sourceDataEnd = 0;
+    this->_sparseTail = 0;
+    this->_advisedOffset = 0;
+    this->_releasedOffset = 0;
+    this->_readLatency = TransferLatency{0, 0, 0};
+    this->_writeLatency = TransferLatency{0, 0, 0};
+    this->_devices = std::pair<dev_t, dev_t>(0, 0);
+    this->_mapOffset = 0;
+    this->_ranged = false;
+    this->_rangeOffset = 0;
+    this->_rangeLength = 0;
+    this->_digestOffset = 0;
+    this->_digestFrom = 0;
+    this->_digestCrc = 0;
+    this->_blockDigests.clear();
+    this->_mirrorPaths.clear();
+    this->_mirrorFds.clear();
+    this->_mirrorBytesWritten.clear();
+    this->_checkpointOffset = 0;
+    this->_positionalOffset = 0;
+    this->_hashStarted = false;
+    this->_sourceChecksum = std::string();
+    this->_buff.reset();
+}
+
+size_t FileCopy::read_to_buffer()
+{
+    /* Copies data from the source to the ring buffer */
+    size_t numBytesRead;
+    
+    if (!this->started)
+    {
+        this->started = true;
+        this->_buff.rotate_processing_index();
+    }
+    
+    if (!_source_open() || !this->_buff.buffers_available()) return 0;
+
+    char* bufferWriteByte = reinterpret_cast<char*>(this->_buff.get_write_byte());
+
+    if (this->_inFd >= 0)
+    {
+        size_t numBytesWanted(this->_buff.bufferLength), gap(0);
+
+        if (this->_slotLengths.size() != this->_buff.ringLength)
+        {
+            this->_slotLengths.assign(this->_buff.ringLength, 0);
+            this->_slotGaps.assign(this->_buff.ringLength, 0);
+        }
+        if (this->_sparse)
+        {
+            /* O_DIRECT reads whole blocks, so the tail of an extent
+            is asked for in full; past the end of the file the read
+            just comes up short, and within it the rest is a hole */
+            numBytesWanted = _seek_source_data(&gap);
+            if ((numBytesWanted % RING_BUFFER_ALIGNMENT) && _is_direct(this->_inFd))
+            {
+                numBytesWanted = std::min(
+                        static_cast<size_t>(this->_buff.bufferLength),
+                        numBytesWanted + RING_BUFFER_ALIGNMENT
+                        - (numBytesWanted % RING_BUFFER_ALIGNMENT)
+                    );
+            }
+        }
+
+        numBytesRead = (
+                numBytesWanted
+                ? _read_fd(bufferWriteByte, numBytesWanted)
+                : 0
+            );
+        if (!numBytesWanted || (numBytesRead < numBytesWanted))
+        {
+            _close_fd(&(this->_inFd));
+        }
+
+        _hash_zeros(gap);
+        if (numBytesRead)
+        {
+            this->_slotLengths[this->_buff.writeIndex] = numBytesRead;
+            this->_slotGaps[this->_buff.writeIndex] = gap;
+            _digest_source(
+                    bufferWriteByte, numBytesRead,
+                    this->_numBytesReadToBuffer + gap
+                );
+            _hash_chunk(bufferWriteByte, numBytesRead);
+        }
+        else
+        {
+            this->_sparseTail += gap;
+        }
+        this->_numBytesReadToBuffer += gap;
+    }
+    else
+    {
+        this->_inStream.read(bufferWriteByte, this->_buff.bufferLength);
+        numBytesRead = this->_inStream.gcount();
+        _digest_source(bufferWriteByte, numBytesRead, this->_numBytesReadToBuffer);
+        _hash_chunk(bufferWriteByte, numBytesRead);
+    }
+
+    if (!numBytesRead)
+    {
+        this->_inStream.close();
+    }
+    else
+    {
+        this->_buff.rotate_partial_write(numBytesRead);
+    }
+
+    this->_numBytesReadToBuffer += numBytesRead;
+
+    return numBytesRead;
+}
+
+size_t FileCopy::_seek_source_data(size_t* gap)
+{
+    /* Moves the source offset past any hole, storing the hole
+    length in gap, and returns how much of the current data
+    extent fits in one slot.  Returns 0 if only a hole is left. */
+    off_t position(lseek(this->_inFd, 0, SEEK_CUR)), data;
+
+    *gap = 0;
+    if (position >= this->_sourceDataEnd)
+    {
+        data = lseek(this->_inFd, position, SEEK_DATA);
+        if (data < 0)
+        {
+            if (errno == ENXIO)
+            {
+                /* Nothing but a hole up to the end of the file */
+                if (get_source_size() > static_cast<size_t>(position))
+                {
+                    *gap = get_source_size() - position;
+                }
+                return 0;
+            }
+
+            /* No SEEK_DATA support; treat everything as data */
+            this->_sourceDataEnd = std::numeric_limits<off_t>::max();
+            return this->_buff.bufferLength;
+        }
+        this->_sourceDataEnd = lseek(this->_inFd, data, SEEK_HOLE);
+        lseek(this->_inFd, data, SEEK_SET);
+        *gap = data - position;
+        position = data;
+    }
+
+    return std::min(
+            static_cast<size_t>(this->_buff.bufferLength),
+            static_cast<size_t>(this->_sourceDataEnd - position)
+        );
+}
+
+bool FileCopy::_extend_sparse_dest()
+{
+    /* Holes and zero blocks at the end of the source were only
+    seeked over, so the destination is grown to its full size */
+    if (!this->_sparse || (_effective_engine() != ENGINE_STREAM) || (this->_outFd < 0))
+    {
+        return true;
+    }
+
+    this->_numBytesWrittenFromBuffer += this->_sparseTail;
+    this->_sparseTail = 0;
+    return (ftruncate(this->_outFd, this->_numBytesWrittenFromBuffer) == 0);
+}
+
+void FileCopy::_set_dest_extent_hint(int fd)
+{
+    /* Hints have to be set while the file has no extents yet */
+    struct fsxattr attributes;
+
+    if (ioctl(fd, FS_IOC_FSGETXATTR, &attributes) < 0) return;
+    attributes.fsx_xflags |= FS_XFLAG_EXTSIZE;
+    attributes.fsx_extsize = this->_extentHint;
+    ioctl(fd, FS_IOC_FSSETXATTR, &attributes);
+}
+
+void FileCopy::_preallocate_dest()
+{
+    /* Reserves space for the whole source in the empty
+    destination.  The size is kept, so a short copy never leaves
+    stale zeros behind, and filesystems without fallocate simply
+    grow the file as it is written. */
+    if (this->_sparse || !get_source_size()) return;
+    if (!this->_preallocate && !this->_extentHint) return;
+
+    /* The stream engine has no descriptor of its own */
+    int fd(this->_outFd);
+    if (fd < 0)
+    {
+        if (!this->_outStream.is_open()) return;
+        fd = ::open(this->dest.c_str(), O_WRONLY);
+        if (fd < 0) return;
+    }
+
+    if (
+            this->_extentHint
+            && !this->_ranged
+            && !this->_rangeOffset
+            && (get_source_size() >= EXTENT_HINT_MIN_FILESIZE)
+        )
+    {
+        _set_dest_extent_hint(fd);
+    }
+    if (this->_preallocate)
+    {
+        fallocate(
+                fd, FALLOC_FL_KEEP_SIZE,
+                this->_rangeOffset,
+                this->_ranged ? this->_rangeLength : (get_source_size() - this->_rangeOffset)
+            );
+    }
+
+    if (fd != this->_outFd)
+    {
+        _close_fd(&fd);
+    }
+}
+
+inline size_t FileCopy::_advice_window()
+{
+    /* Advice is given a whole ring at a time, which keeps it
+    clear of anything still in flight */
+    return static_cast<size_t>(this->_buff.bytesPerBuffer) * this->_buff.ringLength;
+}
+
+void FileCopy::_advise_progress()
+{
+    /* Called by the writer after each chunk.  Once another window
+    has been written, the source window after the reader is
+    requested and, with CACHE_DROP, finished windows released. */
+    if (this->_cachePolicy == CACHE_KEEP) return;
+
+    size_t window(_advice_window());
+    size_t written(this->_numBytesWrittenFromBuffer);
+    if (written < (this->_advisedOffset + window)) return;
+
+    if (this->_inFd >= 0)
+    {
+        posix_fadvise(
+                this->_inFd,
+                this->_rangeOffset + written + window, window,
+                POSIX_FADV_WILLNEED
+            );
+    }
+    if (this->_cachePolicy == CACHE_DROP)
+    {
+        _release_cache(this->_inFd, this->_outFd, written);
+    }
+    this->_advisedOffset = written;
+}
+
+void FileCopy::_release_cache(int sourceFd, int destFd, size_t end)
+{
+    /* Starts writeback up to end, then waits on the window before
+    it, which has had a whole window's time to reach the disk,
+    and drops it from the cache for both files.  Dirty pages
+    cannot be dropped, hence the lag.  Offsets count from the
+    start of the range when only a range is copied. */
+    size_t releaseEnd(this->_advisedOffset), base(this->_rangeOffset);
+
+    if (destFd >= 0)
+    {
+        if (end > releaseEnd)
+        {
+            sync_file_range(destFd, base + releaseEnd, end - releaseEnd, SYNC_FILE_RANGE_WRITE);
+        }
+        if (releaseEnd > this->_releasedOffset)
+        {
+            sync_file_range(
+                    destFd,
+                    base + this->_releasedOffset,
+                    releaseEnd - this->_releasedOffset,
+                    (
+                        SYNC_FILE_RANGE_WAIT_BEFORE
+                        | SYNC_FILE_RANGE_WRITE
+                        | SYNC_FILE_RANGE_WAIT_AFTER
+                    )
+                );
+            posix_fadvise(
+                    destFd,
+                    base + this->_releasedOffset,
+                    releaseEnd - this->_releasedOffset,
+                    POSIX_FADV_DONTNEED
+                );
+        }
+    }
+    if ((sourceFd >= 0) && (releaseEnd > this->_releasedOffset))
+    {
+        if (this->_sourceMap)
+        {
+            /* Mapped pages stay cached until they are unmapped */
+            madvise(
+                    this->_sourceMap + base + this->_releasedOffset,
+                    releaseEnd - this->_releasedOffset,
+                    MADV_DONTNEED
+                );
+        }
+        posix_fadvise(
+                sourceFd,
+                base + this->_releasedOffset,
+                releaseEnd - this->_releasedOffset,
+                POSIX_FADV_DONTNEED
+            );
+    }
+    this->_releasedOffset = releaseEnd;
+}
+
+void FileCopy::_release_cache_tail()
+{
+    /* Releases whatever the last windows left behind, once the
+    files are closed and any source mapping is gone */
+    if (this->_cachePolicy != CACHE_DROP) return;
+    if (!this->_numBytesWrittenFromBuffer) return;
+
+    int sourceFd(this->_inFd), destFd(this->_outFd);
+    if (sourceFd < 0) sourceFd = ::open(this->source.c_str(), O_RDONLY);
+    if (destFd < 0) destFd = ::open(this->dest.c_str(), O_WRONLY);
+
+    /* The loops may have closed a descriptor before its last
+    windows were released, so the whole file is covered; pages
+    already gone cost nothing to drop again */
+    this->_releasedOffset = 0;
+    this->_advisedOffset = this->_numBytesWrittenFromBuffer;
+    _release_cache(sourceFd, destFd, this->_advisedOffset);
+
+    if (sourceFd != this->_inFd) _close_fd(&sourceFd);
+    if (destFd != this->_outFd) _close_fd(&destFd);
+}
+
+std::filesystem::path FileCopy::_checkpoint_path()
+{
+    std::filesystem::path path(this->dest);
+    path += RESUME_CHECKPOINT_SUFFIX;
+    return path;
+}
+
+bool FileCopy::_load_checkpoint(size_t limit)
+{
+    /* Restores the hash state from the destination's checkpoint
+    if it was taken with the same algorithm, from the same source,
+    no further than limit.  Returns false if there is none. */
+    std::ifstream checkpoint(_checkpoint_path(), std::ios::binary);
+    std::string algorithm, state;
+    size_t offset, sourceSize;
+    int64_t sourceTime;
+
+    if (
+            !std::getline(checkpoint, algorithm)
+            || !(checkpoint >> offset >> sourceSize >> sourceTime)
+            || (checkpoint.get() != '\n')
+        )
+    {
+        return false;
+    }
+    state.assign(
+            std::istreambuf_iterator<char>(checkpoint),
+            std::istreambuf_iterator<char>()
+        );
+    if (
+            (algorithm != this->_hashAlgorithm)
+            || (sourceSize != get_source_size())
+            || (sourceTime != this->_sourceMtime)
+            || (offset > limit)
+            || (offset % RING_BUFFER_ALIGNMENT)
+        )
+    {
+        return false;
+    }
+
+    try
+    {
+        this->_hasher->startHash();
+        this->_hasher->loadState(state);
+    }
+    catch (hlException& error)
+    {
+        return false;
+    }
+    this->_hashStarted = true;
+    this->_rangeOffset = offset;
+    return true;
+}
+
+void FileCopy::_write_checkpoint()
+{
+    /* Saves the hash state of the source up to the positional
+    offset, once everything before it is on disk.  The checkpoint
+    is replaced by a rename, so a crash leaves the last one. */
+    std::filesystem::path path(_checkpoint_path()), written(path);
+    std::error_code error;
+
+    if (fdatasync(this->_outFd) < 0) return;
+
+    written += ".tmp";
+    {
+        std::ofstream checkpoint(written, std::ios::binary | std::ios::trunc);
+        checkpoint << this->_hashAlgorithm << '\n';
+        checkpoint << this->_positionalOffset << ' ' << get_source_size() << ' ';
+        checkpoint << this->_sourceMtime << '\n';
+        checkpoint << this->_hasher->saveState();
+        if (!checkpoint.good()) return;
+    }
+    std::filesystem::rename(written, path, error);
+    if (!error) this->_checkpointOffset = this->_positionalOffset;
+}
+
+void FileCopy::_resume_from_dest()
+{
+    /* Continues an existing destination shorter than the source.
+    A hashed copy starts from its last valid checkpoint; otherwise
+    the destination is trusted up to its last whole block.  Small
+    sources are simply copied again. */
+    size_t offset;
+
+    if (!this->_resume || this->source.empty()) return;
+    if (this->_destSizeInBytes >= get_source_size()) return;
+
+    offset = (
+            _small_file()
+            ? 0
+            : (this->_destSizeInBytes / RING_BUFFER_ALIGNMENT * RING_BUFFER_ALIGNMENT)
+        );
+    this->_rangeOffset = offset;
+    if (offset && this->_hasher)
+    {
+        _load_checkpoint(offset);
+    }
+    this->_positionalOffset = this->_rangeOffset;
+    this->_checkpointOffset = this->_rangeOffset;
+    this->_destSizeInBytes = 0;
+
+    #if _DEBUG
+    std::cout << "Resuming destination at " << this->_rangeOffset << std::endl;
+    #endif
+}
+
+void FileCopy::_hash_source_prefix()
+{
+    /* Without a checkpoint, a resumed copy hashes the part of the
+    source already in the destination before copying the rest */
+    size_t offset(0), length;
+    ssize_t numBytesRead;
+
+    if (!this->_hasher || this->_hashStarted || (this->_inFd < 0)) return;
+
+    _hash_start();
+    char* data = reinterpret_cast<char*>(this->_buff.ring[0].data());
+    while (offset < this->_rangeOffset)
+    {
+        length = std::min(
+                static_cast<size_t>(this->_buff.bytesPerBuffer),
+                this->_rangeOffset - offset
+            );
+        numBytesRead = pread(this->_inFd, data, length, offset);
+        if (numBytesRead < 0)
+        {
+            if (errno == EINTR) continue;
+            throw SOURCE_READ_FAILED;
+        }
+        if (!numBytesRead)
+        {
+            throw SOURCE_TRUNCATED;
+        }
+        _hash_chunk(data, numBytesRead);
+        _digest_source(data, numBytesRead, offset);
+        offset += numBytesRead;
+    }
+}
+
+void FileCopy::_stat_source(int fd)
+{
+    /* Takes the source size and mtime with one call,
+    through fd if the source is already open */
+    struct stat status;
+    if (((fd >= 0) ? fstat(fd, &status) : ::stat(this->source.c_str(), &status)) < 0)
+    {
+        get_source_size();
+        return;
+    }
+    this->_sourceSizeInBytes = status.st_size;
+    this->_sourceMtime = (
+            static_cast<int64_t>(status.st_mtim.tv_sec) * 1000000000
+            + status.st_mtim.tv_nsec
+        );
+}
+
+bool FileCopy::_stat_dest(int fd)
+{
+    /* Takes the destination size and mtime with one call,
+    through fd if the destination is already open.
+    Returns false if there is no destination yet. */
+    struct stat status;
+    if (((fd >= 0) ? fstat(fd, &status) : ::stat(this->dest.c_str(), &status)) < 0)
+    {
+        return false;
+    }
+    this->_destSizeInBytes = status.st_size;
+    this->_destMtime = (
+            static_cast<int64_t>(status.st_mtim.tv_sec) * 1000000000
+            + status.st_mtim.tv_nsec
+        );
+    return true;
+}
+
+bool FileCopy::_sampled_match(const std::filesystem::path& path)
+{
+    /* Compares blocks spread evenly over both files, always
+    including the first and the last */
+    std::vector<char> sourceBlock(SKIP_SAMPLE_SIZE), destBlock(SKIP_SAMPLE_SIZE);
+    size_t length(std::min(get_source_size(), static_cast<size_t>(SKIP_SAMPLE_SIZE)));
+    size_t span(get_source_size() - length), offset;
+    bool match(true);
+
+    int sourceFd(::open(this->source.c_str(), O_RDONLY));
+    int destFd(::open(path.c_str(), O_RDONLY));
+    if ((sourceFd < 0) || (destFd < 0)) match = false;
+
+    for (unsigned i(0); match && (i < SKIP_SAMPLE_COUNT); ++i)
+    {
+        offset = (SKIP_SAMPLE_COUNT > 1) ? (span / (SKIP_SAMPLE_COUNT - 1) * i) : 0;
+        if (i == (SKIP_SAMPLE_COUNT - 1)) offset = span;
+        match = (
+                (pread(sourceFd, sourceBlock.data(), length, offset) == static_cast<ssize_t>(length))
+                && (pread(destFd, destBlock.data(), length, offset) == static_cast<ssize_t>(length))
+                && !std::memcmp(sourceBlock.data(), destBlock.data(), length)
+            );
+    }
+
+    _close_fd(&sourceFd);
+    _close_fd(&destFd);
+    return match;
+}
+
+std::string FileCopy::_checksum_file(const std::filesystem::path& path, hashwrapper* hasher)
+{
+    /* Hashes a whole file through the first ring slot.
+    Returns an empty string if the file cannot be read. */
+    char* data = reinterpret_cast<char*>(this->_buff.ring[0].data());
+    ssize_t numBytesRead;
+
+    int fd(::open(path.c_str(), O_RDONLY));
+    if (fd < 0) return std::string();
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    hasher->startHash();
+    while ((numBytesRead = ::read(fd, data, this->_buff.bytesPerBuffer)))
+    {
+        if (numBytesRead < 0)
+        {
+            if (errno == EINTR) continue;
+            _close_fd(&fd);
+            return std::string();
+        }
+        hasher->addData(reinterpret_cast<unsigned char*>(data), numBytesRead);
+    }
+    _close_fd(&fd);
+    return hasher->finishHash();
+}
+
+bool FileCopy::_checksum_match(const std::filesystem::path& path)
+{
+    /* Compares whole file checksums.  When the source is hashed
+    inline its checksum is kept, since a skipped copy never
+    produces one. */
+    wrapperfactory factory;
+    hashwrapper* hasher = factory.create(
+            this->_hashAlgorithm.empty() ? SKIP_CHECKSUM_ALGORITHM : this->_hashAlgorithm
+        );
+    std::string sourceChecksum(_checksum_file(this->source, hasher));
+    std::string destChecksum(_checksum_file(path, hasher));
+    delete hasher;
+
+    if (sourceChecksum.empty() || (sourceChecksum != destChecksum)) return false;
+    if (this->_hasher) this->_sourceChecksum = sourceChecksum;
+    return true;
+}
+
+bool FileCopy::_dest_matches(const std::filesystem::path& path, size_t size, int64_t mtime)
+{
+    /* Applies the skip policy to an existing destination of
+    this size and mtime.  The size and mtime checks only use
+    the stats already taken. */
+    if (!size) return false;
+    if (this->_skipPolicy == SKIP_EXISTS) return true;
+    if (this->source.empty()) return false;
+    if ((size != get_source_size()) || (mtime < this->_sourceMtime))
+    {
+        return false;
+    }
+
+    switch (this->_skipPolicy)
+    {
+        case SKIP_SAMPLED:
+            return _sampled_match(path);
+
+        case SKIP_CHECKSUM:
+            return _checksum_match(path);
+
+        default:
+            return true;
+    }
+}
+
+void FileCopy::_check_existing_dest()
+{
+    /* Decides what happens to an existing destination.  A short
+    one is continued when resuming; otherwise one the skip policy
+    finds different from the source is copied again. */
+    _resume_from_dest();
+    if (
+            should_skip()
+            && !_dest_matches(this->dest, this->_destSizeInBytes, this->_destMtime)
+        )
+    {
+        #if _DEBUG
+        std::cout << "Destination differs from source" << std::endl;
+        #endif
+        this->_destSizeInBytes = 0;
+    }
+}
+
+size_t FileCopy::_write_sparse(char* data, size_t numBytes)
+{
+    /* Writes runs of non-zero blocks and seeks over zero blocks,
+    which leaves holes in the freshly truncated destination */
+    size_t position(0), runStart(0), block;
+
+    while (position < numBytes)
+    {
+        block = std::min(
+                static_cast<size_t>(SPARSE_BLOCK_SIZE),
+                numBytes - position
+            );
+        if (is_zero_block(data + position, block))
+        {
+            if (position > runStart)
+            {
+                _write_fd(data + runStart, position - runStart);
+            }
+            lseek(this->_outFd, block, SEEK_CUR);
+            runStart = position + block;
+        }
+        position += block;
+    }
+
+    if (numBytes > runStart)
+    {
+        _write_fd(data + runStart, numBytes - runStart);
+    }
+
+    return numBytes;
+}
+
+size_t FileCopy::_read_source(char* data, size_t numBytes)
+{
+    /* Reads a chunk from whichever source handle is open */
+    if (this->_inFd >= 0)
+    {
+        return _read_fd(data, numBytes);
+    }
+    this->_inStream.read(data, numBytes);
+    return this->_inStream.gcount();
+}
+
+size_t FileCopy::_write_dest(char* data, size_t numBytes)
+{
+    /* Writes a chunk to whichever destination handle is open */
+    if (this->_outFd >= 0)
+    {
+        return _write_fd(data, numBytes);
+    }
+    if (!this->_outStream.write(data, numBytes))
+    {
+        throw DEST_WRITE_FAILED;
+    }
+    return numBytes;
+}
+
+size_t FileCopy::_write_slot_fd(int numBytesAvailable)
+{
+    /* Writes the current read buffer out to the destination
+    descriptor, closing it once nothing is left to write */
+    size_t numBytesWritten(0);
+
+    if (numBytesAvailable > 0)
+    {
+        if (!this->_firstWritten)
+        {
+            this->_buff.rotate_read_index();
+            this->_firstWritten = true;
+        }
+
+        size_t numBytesBuffered(this->_slotLengths[this->_buff.readIndex]);
+        size_t gap(this->_slotGaps[this->_buff.readIndex]);
+        char* bufferReadByte = reinterpret_cast<char*>(this->_buff.get_read_byte());
+
+        if (this->_sparse)
+        {
+            lseek(this->_outFd, gap, SEEK_CUR);
+            numBytesWritten = _write_sparse(bufferReadByte, numBytesBuffered);
+        }
+        else
+        {
+            numBytesWritten = _write_fd(bufferReadByte, numBytesBuffered);
+        }
+        this->_buff.rotate_partial_read(numBytesWritten);
+        this->_numBytesWrittenFromBuffer += gap + numBytesWritten;
+        _advise_progress();
+    }
+    else
+    {
+        if (!_extend_sparse_dest())
+        {
+            throw DEST_WRITE_FAILED;
+        }
+        _close_fd(&(this->_outFd));
+    }
+
+    return numBytesWritten;
+}
+
+size_t FileCopy::write_from_buffer()
+{
+    /* Writes from the buffer out to the destination */
+    size_t beforePosition, afterPosition(0), numBytesWritten(0);
+    
+    if (!this->started) this->started = true;
+    if (this->_outFd >= 0) return _write_slot_fd(this->_buff.buffered());
+    if (!this->_outStream.is_open()) return 0;
+
+    beforePosition = this->_outStream.tellp();
+
+    if (this->_buff.buffered() > 0)
+    {
+        if (!this->_firstWritten)
+        {
+            this->_buff.rotate_read_index();
+            this->_firstWritten = true;
+        }
+
+        int numBytesBuffered = (
+                (this->_buff.buffered() >= this->_buff.bufferLength)
+                ? this->_buff.bufferLength
+                : this->_buff.buffered()
+            );
+
+        char* bufferReadByte = reinterpret_cast<char*>(this->_buff.get_read_byte());
+        this->_outStream.write(bufferReadByte, numBytesBuffered);
+        afterPosition = this->_outStream.tellp();
+        numBytesWritten += (afterPosition - beforePosition);
+        this->_buff.rotate_partial_read(numBytesWritten);
+        this->_numBytesWrittenFromBuffer += numBytesWritten;
+    }
+
+    if (this->_outStream.is_open() && (afterPosition < beforePosition))
+    {
+        this->_outStream.close();
+    }
+
+    return numBytesWritten;
+}
+
+size_t FileCopy::write_processed_from_buffer()
+{
+    /* Writes data from the buffer out to the destination
+    only if it has been processed while in the buffer */
+    size_t beforePosition, afterPosition(0), numBytesWritten(0);
+    
+    if (!this->started) this->started = true;
+    if (this->_outFd >= 0) return _write_slot_fd(this->_buff.processed());
+    if (!this->_outStream.is_open()) return 0;
+
+    beforePosition = this->_outStream.tellp();
+
+    if (this->_buff.processed() > 0)
+    {
+        if (!this->_firstWritten)
+        {
+            this->_buff.rotate_read_index();
+            this->_firstWritten = true;
+        }
+
+        int numBytesBuffered = (
+                (this->_buff.processed() >= this->_buff.bufferLength)
+                ? this->_buff.bufferLength
+                : this->_buff.processed()
+            );
+
+        char* bufferReadByte = reinterpret_cast<char*>(this->_buff.get_read_byte());
+        this->_outStream.write(bufferReadByte, numBytesBuffered);
+        afterPosition = this->_outStream.tellp();
+        numBytesWritten += (afterPosition - beforePosition);
+        this->_buff.rotate_partial_read(numBytesWritten);
+        this->_numBytesWrittenFromBuffer += numBytesWritten;
+    }
+
+    if (this->_outStream.is_open() && (afterPosition < beforePosition))
+    {
+        this->_outStream.close();
+    }
+
+    return numBytesWritten;
+}
+
+void FileCopy::pre_buffer_source()
+{
+    while (this->_buff.buffers_available() && _source_open())
+    {
+        read_to_buffer();
+    }
+}
+
+bool FileCopy::_kernel_fallback(int err)
+{
+    /* Whether a failed kernel copy call should be retried
+    with the next method instead of being treated as fatal */
+    return (
+            (err == EXDEV)
+            || (err == EINVAL)
+            || (err == ENOSYS)
+            || (err == EOPNOTSUPP)
+            || (err == EBADF)
+        );
+}
+
+ssize_t FileCopy::_splice_chunk(size_t length)
+{
+    /* Moves a chunk through a pipe with splice(2) */
+    ssize_t numBytesPiped, numBytesSpliced, numBytesMoved(0);
+
+    if ((this->_pipeFds[0] < 0) && (pipe(this->_pipeFds) < 0))
+    {
+        return -1;
+    }
+
+    numBytesPiped = splice(
+            this->_inFd, nullptr,
+            this->_pipeFds[1], nullptr,
+            length, SPLICE_F_MOVE
+        );
+    if (numBytesPiped <= 0) return numBytesPiped;
+
+    while (numBytesMoved < numBytesPiped)
+    {
+        numBytesSpliced = splice(
+                this->_pipeFds[0], nullptr,
+                this->_outFd, nullptr,
+                numBytesPiped - numBytesMoved, SPLICE_F_MOVE
+            );
+        if (numBytesSpliced <= 0)
+        {
+            /* Data already taken from the source cannot be put back */
+            throw KERNEL_COPY_FAILED;
+        }
+        numBytesMoved += numBytesSpliced;
+    }
+
+    return numBytesMoved;
+}
+
+ssize_t FileCopy::_kernel_copy_chunk(size_t length)
+{
+    /* Copies a chunk between descriptors without leaving the kernel,
+    falling back to the next method when one is refused.
+    All methods advance the file offsets, so a fallback
+    can pick up mid-file where the last one stopped. */
+    ssize_t numBytesCopied(-1);
+
+    switch (this->_kernelMethod)
+    {
+        case KERNEL_COPY_FILE_RANGE:
+            numBytesCopied = copy_file_range(
+                    this->_inFd, nullptr,
+                    this->_outFd, nullptr,
+                    length, 0
+                );
+            if ((numBytesCopied >= 0) || !_kernel_fallback(errno))
+            {
+                break;
+            }
+            this->_kernelMethod = KERNEL_SENDFILE;
+            [[fallthrough]];
+
+        case KERNEL_SENDFILE:
+            numBytesCopied = sendfile(
+                    this->_outFd,
+                    this->_inFd,
+                    nullptr,
+                    length
+                );
+            if ((numBytesCopied >= 0) || !_kernel_fallback(errno))
+            {
+                break;
+            }
+            this->_kernelMethod = KERNEL_SPLICE;
+            [[fallthrough]];
+
+        case KERNEL_SPLICE:
+            numBytesCopied = _splice_chunk(length);
+            break;
+    }
+
+    return numBytesCopied;
+}
+
+size_t FileCopy::kernel_transfer()
+{
+    /* Moves up to one buffer length from source to destination
+    inside the kernel and returns the number of bytes moved */
+    ssize_t numBytesCopied;
+
+    if (!this->started) this->started = true;
+    if ((this->_inFd < 0) || (this->_outFd < 0)) return 0;
+
+    std::chrono::steady_clock::time_point start(_latency_start());
+    numBytesCopied = _kernel_copy_chunk(this->_buff.bytesPerBuffer);
+    _record_latency(&(this->_writeLatency), start);
+
+    if (numBytesCopied < 0)
+    {
+        throw KERNEL_COPY_FAILED;
+    }
+    else if (!numBytesCopied)
+    {
+        _close_fd(&(this->_inFd));
+        _close_fd(&(this->_outFd));
+    }
+
+    this->_numBytesReadToBuffer += numBytesCopied;
+    this->_numBytesWrittenFromBuffer += numBytesCopied;
+    _advise_progress();
+
+    return numBytesCopied;
+}
+
+bool FileCopy::clone()
+{
+    /* Clones the source extents into the destination with FICLONE.
+    Returns false without touching the destination if the filesystem
+    cannot reflink between the two (EXDEV, EOPNOTSUPP, EINVAL).
+    Device numbers are not compared first: btrfs subvolumes report
+    different ones yet reflink between each other. */
+    int inFd(this->_inFd), outFd(this->_outFd);
+    bool cloned(false);
+
+    if (inFd < 0) inFd = ::open(this->source.c_str(), O_RDONLY);
+    if (outFd < 0) outFd = ::open(this->dest.c_str(), O_WRONLY);
+
+    if ((inFd >= 0) && (outFd >= 0))
+    {
+        cloned = !ioctl(outFd, FICLONE, inFd);
+    }
+
+    if (inFd != this->_inFd && inFd >= 0) ::close(inFd);
+    if (outFd != this->_outFd && outFd >= 0) ::close(outFd);
+
+    if (cloned)
+    {
+        this->_numBytesCloned = get_source_size();
+        close();
+    }
+
+    #if _DEBUG
+    std::cout << (cloned ? "Cloned " : "Could not clone ");
+    std::cout << this->source.string() << std::endl;
+    #endif
+
+    return cloned;
+}
+
+inline void FileCopy::_hash_start()
+{
+    if (this->_hasher && !this->_hashStarted)
+    {
+        this->_hasher->startHash();
+        this->_hashStarted = true;
+    }
+}
+
+inline void FileCopy::_hash_chunk(const char* data, size_t numBytes)
+{
+    /* Feeds source data to the hasher, if there is one */
+    if (!this->_hasher) return;
+    _hash_start();
+    this->_hasher->addData(
+            reinterpret_cast<const unsigned char*>(data),
+            numBytes
+        );
+}
+
+void FileCopy::_hash_zeros(size_t numBytes)
+{
+    /* Feeds a hole skipped in a sparse source to the hasher
+    as the zeros it reads back as */
+    static const char zeros[RING_BUFFER_ALIGNMENT] = {};
+    while (this->_hasher && numBytes)
+    {
+        size_t numZeros(std::min(numBytes, sizeof(zeros)));
+        _hash_chunk(zeros, numZeros);
+        numBytes -= numZeros;
+    }
+}
+
+void FileCopy::_hash_mapped(const char* data, size_t numBytes)
+{
+    /* Hashes and digests from the source mapping, turning the SIGBUS raised
+    by a source truncated underneath us into an exception */
+    sigjmp_buf jump;
+
+    if (!this->_hasher && !this->_digestBlockSize) return;
+    std::call_once(sigbusHandlerInstalled, install_sigbus_handler);
+
+    if (sigsetjmp(jump, 1))
+    {
+        sigbusJump = nullptr;
+        throw SOURCE_TRUNCATED;
+    }
+    sigbusJump = &jump;
+    _digest_source(data, numBytes, this->_mapOffset);
+    _hash_chunk(data, numBytes);
+    sigbusJump = nullptr;
+}
+
+bool FileCopy::_mapping_truncated(const char* data)
+{
+    /* Whether data lies in the source mapping past the end of a
+    source truncated underneath us, found by touching it under
+    the SIGBUS guard */
+    sigjmp_buf jump;
+    volatile char byte;
+
+    if (
+            !this->_sourceMap
+            || (data < this->_sourceMap)
+            || (data >= this->_sourceMap + get_source_size())
+        )
+    {
+        return false;
+    }
+    std::call_once(sigbusHandlerInstalled, install_sigbus_handler);
+
+    if (sigsetjmp(jump, 1))
+    {
+        sigbusJump = nullptr;
+        return true;
+    }
+    sigbusJump = &jump;
+    byte = *data;
+    sigbusJump = nullptr;
+    (void)byte;
+    return false;
+}
+
+void FileCopy::_digest_source(const char* data, size_t numBytes, size_t offset)
+{
+    /* Folds source data found at offset into the digest of its
+    block, recording each block as it is completed.  Data that
+    does not follow on from the last call starts over, so a block
+    only partly seen, as at the edges of a range, is left out. */
+    size_t length, block, blockSize(this->_digestBlockSize);
+
+    if (!blockSize || !numBytes) return;
+    if (offset != this->_digestOffset)
+    {
+        this->_digestOffset = offset;
+        this->_digestFrom = offset;
+        this->_digestCrc = 0;
+    }
+
+    while (numBytes)
+    {
+        length = std::min(numBytes, blockSize - (this->_digestOffset % blockSize));
+        this->_digestCrc = crc32c(this->_digestCrc, data, length);
+        this->_digestOffset += length;
+        data += length;
+        numBytes -= length;
+
+        if ((this->_digestOffset % blockSize) && (this->_digestOffset < get_source_size()))
+        {
+            continue;
+        }
+        if (!(this->_digestFrom % blockSize))
+        {
+            if (this->_blockDigests.empty())
+            {
+                this->_blockDigests.assign(
+                        (get_source_size() + blockSize - 1) / blockSize,
+                        BLOCK_DIGEST_NONE
+                    );
+            }
+            block = this->_digestFrom / blockSize;
+            if (block < this->_blockDigests.size())
+            {
+                this->_blockDigests[block] = this->_digestCrc;
+            }
+        }
+        this->_digestFrom = this->_digestOffset;
+        this->_digestCrc = 0;
+    }
+}
+
+bool FileCopy::_map_source()
+{
+    /* Maps the whole source for sequential access.
+    Empty sources need no mapping. */
+    void* mapped;
+
+    this->_mapOffset = 0;
+    if (get_source_size())
+    {
+        mapped = mmap(
+                nullptr, get_source_size(),
+                PROT_READ, MAP_SHARED,
+                this->_inFd, 0
+            );
+        if (mapped == MAP_FAILED)
+        {
+            return false;
+        }
+        madvise(mapped, get_source_size(), MADV_SEQUENTIAL);
+        this->_sourceMap = static_cast<char*>(mapped);
+    }
+    _hash_start();
+    return true;
+}
+
+void FileCopy::_unmap_source()
+{
+    if (this->_sourceMap)
+    {
+        munmap(this->_sourceMap, get_source_size());
+        this->_sourceMap = nullptr;
+    }
+}
+
+size_t FileCopy::mmap_transfer()
+{
+    /* Writes up to one buffer length straight from the source
+    mapping, hashing the same bytes on the way.
+    Returns the number of bytes written. */
+    size_t numBytes;
+
+    if (!this->started) this->started = true;
+    if ((this->_inFd < 0) || (this->_outFd < 0)) return 0;
+
+    numBytes = std::min(
+            static_cast<size_t>(this->_buff.bytesPerBuffer),
+            get_source_size() - this->_mapOffset
+        );
+
+    if (!numBytes)
+    {
+        _unmap_source();
+        _close_fd(&(this->_inFd));
+        _close_fd(&(this->_outFd));
+        return 0;
+    }
+
+    char* data = this->_sourceMap + this->_mapOffset;
+    _hash_mapped(data, numBytes);
+    numBytes = _write_fd(data, numBytes);
+
+    this->_mapOffset += numBytes;
+    this->_numBytesReadToBuffer += numBytes;
+    this->_numBytesWrittenFromBuffer += numBytes;
+    _advise_progress();
+
+    return numBytes;
+}
+
+size_t FileCopy::small_transfer()
+{
+    /* Moves a source that fits in one ring slot with one read
+    and one write, hashing from the same buffer.
+    Returns the number of bytes written. */
+    size_t numBytes;
+
+    if (!this->started) this->started = true;
+    if ((this->_inFd < 0) || (this->_outFd < 0)) return 0;
+
+    char* data = reinterpret_cast<char*>(this->_buff.get_write_byte());
+    numBytes = _read_fd(data, this->_buff.bytesPerBuffer);
+
+    _hash_start();
+    _hash_chunk(data, numBytes);
+    _digest_source(data, numBytes, 0);
+    numBytes = _write_fd(data, numBytes);
+
+    this->_numBytesReadToBuffer += numBytes;
+    this->_numBytesWrittenFromBuffer += numBytes;
+    _close_fd(&(this->_inFd));
+    _close_fd(&(this->_outFd));
+
+    return numBytes;
+}
+
+size_t FileCopy::positional_transfer()
+{
+    /* Reads into every ring slot with one preadv, hashes the
+    slots in order and writes them back out with one pwritev.
+    Offsets are explicit, so the descriptors are never seeked.
+    Returns the number of bytes written. */
+    size_t numBytesRead, numBytes, numBytesWanted, numBytesRequested;
+
+    if (!this->started) this->started = true;
+    if ((this->_inFd < 0) || (this->_outFd < 0)) return 0;
+
+    numBytesWanted = static_cast<size_t>(this->_buff.bytesPerBuffer) * this->_buff.ringLength;
+    numBytesRequested = numBytesWanted;
+    if (this->_ranged)
+    {
+        numBytesWanted = std::min(
+                numBytesWanted,
+                this->_rangeOffset + this->_rangeLength - this->_positionalOffset
+            );
+
+        /* O_DIRECT reads whole blocks; anything past the range
+        is read but not written */
+        numBytesRequested = (
+                this->_direct
+                ? (
+                    (numBytesWanted + RING_BUFFER_ALIGNMENT - 1)
+                    / RING_BUFFER_ALIGNMENT
+                    * RING_BUFFER_ALIGNMENT
+                )
+                : numBytesWanted
+            );
+    }
+    numBytesRead = _preadv_fd(numBytesRequested, this->_positionalOffset);
+    numBytesRead = std::min(static_cast<size_t>(numBytesRead), numBytesWanted);
+    numBytes = numBytesRead;
+    if (!this->_ranged) _hash_start();
+    for (uint8_t i(0); numBytes; ++i)
+    {
+        size_t length = std::min(numBytes, static_cast<size_t>(this->_buff.bytesPerBuffer));
+        char* data = reinterpret_cast<char*>(this->_buff.ring[i].data());
+        _digest_source(
+                data, length,
+                this->_positionalOffset + (static_cast<size_t>(i) * this->_buff.bytesPerBuffer)
+            );
+        if (!this->_ranged) _hash_chunk(data, length);
+        numBytes -= length;
+    }
+
+    numBytes = _pwritev_fd(numBytesRead, this->_positionalOffset);
+    this->_positionalOffset += numBytes;
+    this->_numBytesReadToBuffer += numBytes;
+    this->_numBytesWrittenFromBuffer += numBytes;
+    _advise_progress();
+
+    if (
+            this->_resume
+            && this->_hashStarted
+            && this->_checkpointInterval
+            && (static_cast<size_t>(numBytesRead) == numBytesWanted)
+            && (this->_positionalOffset >= (this->_checkpointOffset + this->_checkpointInterval))
+        )
+    {
+        _write_checkpoint();
+    }
+
+    if (
+            (static_cast<size_t>(numBytesRead) < numBytesWanted)
+            || (
+                this->_ranged
+                && (this->_positionalOffset >= (this->_rangeOffset + this->_rangeLength))
+            )
+        )
+    {
+        /* A short read or the end of the range */
+        _close_fd(&(this->_inFd));
+        _close_fd(&(this->_outFd));
+    }
+
+    return numBytes;
+}
+
+bool FileCopy::_uring_ready()
+{
+    /* Sets up a private queue unless one was shared with this copier.
+    Returns false if io_uring is not available on this system. */
+    if (!this->_uring)
+    {
+        if (!this->_ownUring.ready() && !this->_ownUring.setup(this->_queueDepth))
+        {
+            return false;
+        }
+        this->_uring = &(this->_ownUring);
+    }
+    return this->_uring->ready();
+}
+
+void FileCopy::_uring_prepare()
+{
+    /* Hands the ring buffer slots over to io_uring */
+    uint8_t numSlots = std::min(
+            this->_queueDepth,
+            static_cast<unsigned>(this->_buff.ringLength)
+        );
+    this->_uringSlots.assign(numSlots, UringSlot());
+    for (uint8_t i(0); i < numSlots; ++i)
+    {
+        this->_uringSlots[i].owner = this;
+        this->_uringSlots[i].index = i;
+        this->_uringSlots[i].state = SLOT_FREE;
+    }
+}
+
+void FileCopy::_uring_read(UringSlot* slot)
+{
+    /* Queues the unread part of a slot.  Always asks for the
+    rest of a whole slot so O_DIRECT reads stay aligned; the
+    read comes back short at the end of the file. */
+    if (!this->_uring->available())
+    {
+        slot->state = SLOT_READ_PENDING;
+        return;
+    }
+    this->_uring->prep_read(
+            this->_inFd,
+            &(this->_buff.ring[slot->index][slot->length]),
+            this->_buff.bytesPerBuffer - slot->length,
+            slot->offset + slot->length,
+            reinterpret_cast<uint64_t>(slot)
+        );
+    slot->state = SLOT_READING;
+    ++this->_uringInFlight;
+}
+
+void FileCopy::_uring_write(UringSlot* slot)
+{
+    /* Queues the unwritten part of a slot.  An unaligned O_DIRECT
+    tail is held back until everything else has completed. */
+    size_t numBytes(slot->length - slot->done);
+    if (
+            !this->_uring->available()
+            || (this->_direct && (numBytes % RING_BUFFER_ALIGNMENT))
+        )
+    {
+        slot->state = SLOT_WRITE_PENDING;
+        return;
+    }
+    this->_uring->prep_write(
+            this->_outFd,
+            &(this->_buff.ring[slot->index][slot->done]),
+            numBytes,
+            slot->offset + slot->done,
+            reinterpret_cast<uint64_t>(slot)
+        );
+    slot->state = SLOT_WRITING;
+    ++this->_uringInFlight;
+}
+
+void FileCopy::uring_submit()
+{
+    /* Queues reads and writes that were held back, then
+    reads into every free slot until the source is covered */
+    int flags;
+
+    if (!this->started) this->started = true;
+    if (this->_uringSlots.empty()) _uring_prepare();
+
+    for (UringSlot& slot: this->_uringSlots)
+    {
+        if (!this->_uring->available()) return;
+        if (slot.state == SLOT_READ_PENDING) _uring_read(&slot);
+        if (slot.state != SLOT_WRITE_PENDING) continue;
+        if (this->_direct && ((slot.length - slot.done) % RING_BUFFER_ALIGNMENT))
+        {
+            if (this->_uringInFlight) continue;
+            flags = fcntl(this->_outFd, F_GETFL);
+            if ((flags >= 0) && (flags & O_DIRECT))
+            {
+                fcntl(this->_outFd, F_SETFL, flags & ~O_DIRECT);
+            }
+            this->_direct = false;
+            _uring_write(&slot);
+            this->_direct = true;
+        }
+        else
+        {
+            _uring_write(&slot);
+        }
+    }
+
+    for (UringSlot& slot: this->_uringSlots)
+    {
+        if (
+                !this->_uring->available()
+                || this->_uringSourceEnded
+                || (this->_uringReadOffset >= get_source_size())
+            ) return;
+        if (slot.state != SLOT_FREE) continue;
+
+        slot.offset = this->_uringReadOffset;
+        slot.length = 0;
+        slot.done = 0;
+        _uring_read(&slot);
+        this->_uringReadOffset += this->_buff.bytesPerBuffer;
+    }
+}
+
+void FileCopy::uring_complete(UringSlot* slot, int32_t result)
+{
+    /* Handles a completed read or write for one of this copier's slots */
+    size_t expected, end;
+
+    --this->_uringInFlight;
+
+    if (slot->state == SLOT_READING)
+    {
+        if (result < 0) throw SOURCE_READ_FAILED;
+        end = slot->offset + slot->length;
+        if (!result)
+        {
+            /* The source shrank after it was opened.  Data already
+            read beyond here would leave a gap in the destination. */
+            if (this->_uringDataEnd > end) throw SOURCE_TRUNCATED;
+            this->_uringSourceEnded = true;
+            this->_uringSourceEnd = end;
+            if (!slot->length)
+            {
+                slot->state = SLOT_FREE;
+                return;
+            }
+        }
+        else
+        {
+            if (this->_uringSourceEnded && (end >= this->_uringSourceEnd))
+            {
+                throw SOURCE_TRUNCATED;
+            }
+            _digest_source(
+                    reinterpret_cast<char*>(&(this->_buff.ring[slot->index][slot->length])),
+                    result, end
+                );
+            slot->length += result;
+            this->_numBytesReadToBuffer += result;
+            this->_uringDataEnd = std::max(this->_uringDataEnd, slot->offset + slot->length);
+
+            expected = std::min(
+                    static_cast<size_t>(this->_buff.bytesPerBuffer),
+                    get_source_size() - slot->offset
+                );
+            if (slot->length < expected)
+            {
+                if (!_is_direct(this->_inFd) || !(slot->length % RING_BUFFER_ALIGNMENT))
+                {
+                    /* Short read; queue the rest */
+                    _uring_read(slot);
+                    return;
+                }
+
+                /* O_DIRECT only comes back unaligned at the end of the file */
+                if (this->_uringDataEnd > slot->offset + slot->length) throw SOURCE_TRUNCATED;
+                this->_uringSourceEnded = true;
+                this->_uringSourceEnd = slot->offset + slot->length;
+            }
+        }
+        slot->hashed = !this->_hasher;
+        _uring_write(slot);
+        _uring_hash_in_order();
+    }
+    else
+    {
+        if (result < 0) throw DEST_WRITE_FAILED;
+        slot->done += result;
+        this->_numBytesWrittenFromBuffer += result;
+        _advise_progress();
+        if (slot->done < slot->length)
+        {
+            /* Short write; queue the rest */
+            _uring_write(slot);
+        }
+        else
+        {
+            slot->state = slot->hashed ? SLOT_FREE : SLOT_HASH_PENDING;
+        }
+    }
+}
+
+void FileCopy::_uring_hash_in_order()
+{
+    /* Reads complete in any order, but the hash has to see the
+    source in order.  Hashes every slot that continues from the
+    last one hashed; a slot written before its turn waits for it
+    before being freed. */
+    bool advanced(true);
+    while (advanced)
+    {
+        advanced = false;
+        for (UringSlot& slot: this->_uringSlots)
+        {
+            if (
+                    (slot.state == SLOT_FREE)
+                    || (slot.state == SLOT_READING)
+                    || (slot.state == SLOT_READ_PENDING)
+                    || slot.hashed
+                    || (slot.offset != this->_uringHashOffset)
+                )
+            {
+                continue;
+            }
+            _hash_chunk(
+                    reinterpret_cast<char*>(this->_buff.ring[slot.index].data()),
+                    slot.length
+                );
+            slot.hashed = true;
+            this->_uringHashOffset += slot.length;
+            if (slot.state == SLOT_HASH_PENDING) slot.state = SLOT_FREE;
+            advanced = true;
+        }
+    }
+}
+
+void FileCopy::uring_dispatch(const UringCompletion& completion)
+{
+    /* Routes a completion from a shared queue to its copier */
+    UringSlot* slot = reinterpret_cast<UringSlot*>(completion.userData);
+    slot->owner->uring_complete(slot, completion.result);
+}
+
+bool FileCopy::uring_done()
+{
+    /* Whether every byte of the source has been read and written.
+    With nothing in flight or held back, a slot still waiting to be
+    hashed is waiting on a part of the source no read will return,
+    so the copy fails instead of waiting for it forever. */
+    bool hashPending(false);
+
+    if (!this->started || this->_uringInFlight) return false;
+    for (UringSlot& slot: this->_uringSlots)
+    {
+        if (slot.state == SLOT_HASH_PENDING)
+        {
+            hashPending = true;
+            continue;
+        }
+        if (slot.state != SLOT_FREE) return false;
+    }
+    if (hashPending) throw SOURCE_TRUNCATED;
+    return (
+            this->_uringSourceEnded
+            || (this->_uringReadOffset >= get_source_size())
+        );
+}
+
+size_t FileCopy::uring_transfer()
+{
+    /* Submits, waits for at least one completion and handles
+    everything that finished.  Returns the bytes written. */
+    UringCompletion completions[64];
+    size_t numBytesBefore(this->_numBytesWrittenFromBuffer);
+    unsigned numCompleted;
+
+    uring_submit();
+    numCompleted = this->_uring->wait(completions, 64);
+    for (unsigned i(0); i < numCompleted; ++i)
+    {
+        uring_dispatch(completions[i]);
+    }
+
+    return this->_numBytesWrittenFromBuffer - numBytesBefore;
+}
+
+void FileCopy::_run_threaded()
+{
+    /* Reads on a second thread while this one writes.  Slots pass
+    between them through the ring's single producer/consumer mode,
+    so the two sides only ever wait on each other when it is
+    full or empty.  Hashing and block digests run as ring stages
+    between them, each on a thread of its own, so they overlap
+    with the reads and writes and with each other. */
+    std::exception_ptr readError;
+    uint32_t numBytes;
+    char* slot;
+    std::vector<std::thread> stages;
+    uint8_t numStages(0);
+    size_t startOffset(this->_numBytesReadToBuffer);
+
+    if (this->_hasher) ++numStages;
+    if (this->_digestBlockSize) ++numStages;
+    this->_buff.spsc_set_stages(numStages);
+
+    auto runStage = [this, startOffset](uint8_t stage, bool hash)
+    {
+        char* slot;
+        uint32_t numBytes;
+        size_t offset(startOffset);
+        while ((slot = this->_buff.stage_acquire(stage, &numBytes)))
+        {
+            if (hash)
+            {
+                _hash_chunk(slot, numBytes);
+            }
+            else
+            {
+                _digest_source(slot, numBytes, offset);
+            }
+            offset += numBytes;
+            this->_buff.stage_release(stage);
+        }
+    };
+    if (this->_hasher) stages.emplace_back(runStage, stages.size(), true);
+    if (this->_digestBlockSize) stages.emplace_back(runStage, stages.size(), false);
+
+    std::thread reader([this, &readError]()
+    {
+        char* slot;
+        size_t numBytesRead;
+        try
+        {
+            while ((slot = this->_buff.spsc_acquire_write()))
+            {
+                numBytesRead = _read_source(slot, this->_buff.bytesPerBuffer);
+                if (numBytesRead)
+                {
+                    this->_buff.spsc_commit_write(numBytesRead);
+                    this->_numBytesReadToBuffer += numBytesRead;
+                }
+                if (numBytesRead < this->_buff.bytesPerBuffer) break;
+            }
+        }
+        catch (...)
+        {
+            /* Rethrown once the reader is joined */
+            readError = std::current_exception();
+        }
+        this->_buff.spsc_close();
+    });
+
+    try
+    {
+        while ((slot = this->_buff.spsc_acquire_read(&numBytes)))
+        {
+            this->_numBytesWrittenFromBuffer += _write_dest(slot, numBytes);
+            this->_buff.spsc_release_read();
+            _advise_progress();
+        }
+    }
+    catch (...)
+    {
+        /* Stop the reader, and let the stages drain, before giving up */
+        this->_buff.spsc_close();
+        reader.join();
+        for (std::thread& stage: stages)
+        {
+            stage.join();
+        }
+        throw;
+    }
+
+    reader.join();
+    for (std::thread& stage: stages)
+    {
+        stage.join();
+    }
+    if (readError)
+    {
+        std::rethrow_exception(readError);
     }
-    #endif
-    this->dest.replace_filename(this->source.filename());
 }
 
-void FileCopy::open_dest()
+inline std::chrono::steady_clock::time_point FileCopy::_latency_start()
 {
-    open_dest(std::filesystem::path(_rename_dest()));
+    return (
+            this->_adaptive
+            ? std::chrono::steady_clock::now()
+            : std::chrono::steady_clock::time_point()
+        );
 }
 
-size_t FileCopy::get_source_size()
+inline void FileCopy::_record_latency(
+        TransferLatency* latency,
+        std::chrono::steady_clock::time_point start
+    )
 {
-    /* Get source file size */
-    if (!this->_sourceSizeInBytes)
+    if (!this->_adaptive) return;
+    double seconds = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start
+        ).count();
+    ++latency->numChunks;
+    latency->totalSeconds += seconds;
+    latency->maxSeconds = std::max(latency->maxSeconds, seconds);
+}
+
+std::pair<dev_t, dev_t> FileCopy::_device_pair()
+{
+    /* Source and destination devices, or zeros if either
+    descriptor is not open */
+    struct stat sourceStat, destStat;
+    if (
+            (this->_inFd < 0) || (this->_outFd < 0)
+            || (fstat(this->_inFd, &sourceStat) < 0)
+            || (fstat(this->_outFd, &destStat) < 0)
+        )
     {
-        this->_sourceSizeInBytes = std::filesystem::file_size(this->source);
+        return std::pair<dev_t, dev_t>(0, 0);
     }
-    return this->_sourceSizeInBytes;
+    return std::pair<dev_t, dev_t>(sourceStat.st_dev, destStat.st_dev);
 }
 
-size_t FileCopy::get_dest_size()
+void FileCopy::_apply_learned_geometry()
 {
-    /* Get destination file size */
-    #if _DEBUG
-    std::cout << "Checking dest file size" << std::endl;
-    if (started && !complete())
+    /* Resizes the ring to what earlier files between the same
+    devices settled on, or back to the configured geometry if
+    nothing has been learned for them, so one device pair's
+    geometry is not carried over to another.  Nothing is
+    buffered yet at this point. */
+    BufferGeometry geometry;
+    bool found;
+    this->_devices = _device_pair();
     {
-        std::cerr << "Cannot get dest size; ";
-        std::cerr << "incomplete copy in progress" << std::endl;
-        return 0;
+        std::lock_guard<std::mutex> lock(learnedGeometryMutex);
+        auto learned = learnedGeometry.find(this->_devices);
+        found = (learned != learnedGeometry.end());
+        if (found) geometry = learned->second;
     }
-    #endif
-    if (!this->_destSizeInBytes)
+    if (!this->_geometryLearned)
     {
-        this->_destSizeInBytes = std::filesystem::file_size(this->dest);
+        if (!found) return;
+        this->_configuredGeometry = get_geometry();
     }
-    return this->_destSizeInBytes;
+    else if (!found)
+    {
+        geometry = this->_configuredGeometry;
+    }
+    this->_geometryLearned = found;
+    set_ring_depth(geometry.ringDepth);
+    set_chunk_size(geometry.chunkSize);
 }
 
-size_t FileCopy::bytes_remaining()
+void FileCopy::_learn_geometry()
 {
-    return this->_numBytesReadToBuffer - this->_numBytesWrittenFromBuffer;
+    /* Adjusts the geometry for this device pair from the chunk
+    timings of the transfer that just finished.  Chunks that are
+    too quick spend too much time in syscalls, and chunks that are
+    too slow hold up the other side, so the chunk size doubles or
+    halves towards the latency targets.  The ring deepens when
+    the slowest chunk is far behind the average, and gets
+    shallower again when timings are steady. */
+    TransferLatency* slower;
+    double mean;
+    BufferGeometry geometry(get_geometry());
+
+    /* The kernel and mmap engines only time their writes */
+    slower = &(this->_writeLatency);
+    if (
+            this->_readLatency.numChunks
+            && (
+                !slower->numChunks
+                || (
+                    (this->_readLatency.totalSeconds / this->_readLatency.numChunks)
+                    > (slower->totalSeconds / slower->numChunks)
+                )
+            )
+        )
+    {
+        slower = &(this->_readLatency);
+    }
+    if (slower->numChunks < ADAPTIVE_MIN_SAMPLES) return;
+    if (this->_devices == std::pair<dev_t, dev_t>(0, 0)) return;
+    mean = slower->totalSeconds / slower->numChunks;
+
+    if ((mean < ADAPTIVE_LATENCY_LOW) && (geometry.chunkSize < ADAPTIVE_CHUNK_MAX))
+    {
+        geometry.chunkSize *= 2;
+    }
+    else if ((mean > ADAPTIVE_LATENCY_HIGH) && (geometry.chunkSize > ADAPTIVE_CHUNK_MIN))
+    {
+        geometry.chunkSize /= 2;
+    }
+
+    if ((slower->maxSeconds > (4 * mean)) && (geometry.ringDepth < ADAPTIVE_DEPTH_MAX))
+    {
+        geometry.ringDepth *= 2;
+    }
+    else if ((slower->maxSeconds < (2 * mean)) && (geometry.ringDepth > RING_BUFFER_DEPTH))
+    {
+        geometry.ringDepth /= 2;
+    }
+
+    std::lock_guard<std::mutex> lock(learnedGeometryMutex);
+    learnedGeometry[this->_devices] = geometry;
 }
 
-bool FileCopy::ready()
+bool FileCopy::_small_file()
 {
-    /* Indicates if both files are open and ready to transfer */
-    return (this->_inStream.is_open() && this->_outStream.is_open());
+    /* Whether the source takes the single read and write path */
+    return (
+            this->_smallFileThreshold
+            && !this->_sparse
+            && !this->_ranged
+            && !this->source.empty()
+            && (get_source_size() <= this->_smallFileThreshold)
+            && (get_source_size() <= static_cast<size_t>(this->_buff.bytesPerBuffer))
+        );
 }
 
-void FileCopy::close()
+copy_engine FileCopy::_effective_engine()
 {
-    #if _DEBUG
-    std::cout << "Closing files..." << std::endl;
-    #endif
-    this->_inStream.close();
-    this->_outStream.close();
+    /* Ranges and continued copies need explicit offsets,
+    and holes are only tracked through the ring buffer */
+    if (this->_ranged || this->_rangeOffset) return ENGINE_POSITIONAL;
+    return this->_sparse ? ENGINE_STREAM : this->_engine;
 }
 
-bool FileCopy::complete()
+void FileCopy::_run_buffered()
 {
-    return (
-            this->started
-            && !ready()
-            && !bytes_remaining()
-            && !this->_buff.buffered()
-        );
+    /* Alternates writes and reads through the ring buffer
+    until the transfer is complete */
+    if (this->_threaded && !this->_sparse)
+    {
+        _run_threaded();
+        return;
+    }
+
+    pre_buffer_source();
+    while (!complete())
+    {
+        write_from_buffer();
+        read_to_buffer();
+    }
 }
 
-void FileCopy::reset()
+bool FileCopy::should_skip()
 {
-    close();
-    this->source = std::filesystem::path();
-    this->dest = std::filesystem::path();
-    this->started = false;
-    this->_firstWritten = false;
-    this->_sourceSizeInBytes = 0;
-    this->_destSizeInBytes = 0;
-    this->_numBytesReadToBuffer = 0;
-    this->_numBytesWrittenFromBuffer = 0;
-    this->_buff.reset();
+    /* Whether an existing destination, and any mirrors,
+    will be left alone */
+    return (this->_destSizeInBytes && !this->_overwrite && !_mirrored());
 }
 
-size_t FileCopy::read_to_buffer()
+bool FileCopy::_mirrored()
 {
-    /* Copies data from the source to the ring buffer */
-    size_t numBytesRead;
-    
-    if (!this->started)
+    /* Whether any mirror is open to be written */
+    for (int fd: this->_mirrorFds)
     {
-        this->started = true;
-        this->_buff.rotate_processing_index();
+        if (fd >= 0) return true;
     }
-    
-    if (!this->_inStream.is_open() || !this->_buff.buffers_available()) return 0;
-
-    char* bufferWriteByte = reinterpret_cast<char*>(this->_buff.get_write_byte());
-    this->_inStream.read(bufferWriteByte, this->_buff.bufferLength);
+    return false;
+}
 
-    numBytesRead = this->_inStream.gcount();
+void FileCopy::_run_fan_out()
+{
+    /* Reads each chunk of the source once, hashing it there, and
+    has one writer thread per open destination write it from the
+    same ring slot.  A slot is only refilled once every destination
+    has written it, so a fast destination runs up to the mirror lag
+    ahead of a slow one before the reader waits for the slow one.
+    A destination that fails stops holding the others back, and its
+    error is thrown once they have finished. */
+    std::vector<int> fds, errors;
+    std::vector<size_t> numSlotsWritten, numBytesWritten;
+    std::vector<std::thread> writers;
+    std::mutex lock;
+    std::condition_variable changed;
+    size_t numSlotsFilled(0), numBytesRead;
+    bool sourceEnded(false);
+    int readError(0);
+    uint8_t ringLength(this->_buff.ringLength), lag(this->_mirrorLag);
 
-    if (!numBytesRead)
+    /* No more lag than the source has chunks, so a ring that
+    already holds the whole file is never reallocated for it */
+    lag = static_cast<uint8_t>(std::min(
+            static_cast<size_t>(lag),
+            (get_source_size() / this->_buff.bytesPerBuffer) + 1
+        ));
+    if (ringLength < lag)
     {
-        this->_inStream.close();
+        this->_buff.set_size(this->_buff.bufferLength, lag);
     }
-    else
+    this->_slotLengths.assign(this->_buff.ringLength, 0);
+
+    /* The destination itself, if it is not being left alone,
+    then every mirror that is open */
+    if (_dest_open()) fds.push_back(this->_outFd);
+    for (int fd: this->_mirrorFds)
     {
-        this->_buff.rotate_partial_write(numBytesRead);
+        if (fd >= 0) fds.push_back(fd);
     }
+    errors.assign(fds.size(), 0);
+    numSlotsWritten.assign(fds.size(), 0);
+    numBytesWritten.assign(fds.size(), 0);
 
-    this->_numBytesReadToBuffer += numBytesRead;
+    auto slowest = [&]()
+    {
+        /* Slots written by the slowest destination still writing */
+        size_t numSlots(numSlotsFilled);
+        for (size_t i(0); i < fds.size(); ++i)
+        {
+            if (!errors[i]) numSlots = std::min(numSlots, numSlotsWritten[i]);
+        }
+        return numSlots;
+    };
 
-    return numBytesRead;
-}
+    for (size_t i(0); i < fds.size(); ++i)
+    {
+        writers.emplace_back([&, i]()
+        {
+            size_t slot, length;
+            while (true)
+            {
+                {
+                    std::unique_lock<std::mutex> guard(lock);
+                    changed.wait(guard, [&]()
+                    {
+                        return (numSlotsWritten[i] < numSlotsFilled) || sourceEnded;
+                    });
+                    if (numSlotsWritten[i] >= numSlotsFilled) return;
+                    slot = numSlotsWritten[i] % this->_buff.ringLength;
+                    length = this->_slotLengths[slot];
+                }
 
-size_t FileCopy::write_from_buffer()
-{
-    /* Writes from the buffer out to the destination */
-    size_t beforePosition, afterPosition(0), numBytesWritten(0);
-    
-    if (!this->started) this->started = true;
-    if (!this->_outStream.is_open()) return 0;
+                char* data = reinterpret_cast<char*>(this->_buff.ring[slot].data());
+                try
+                {
+                    if (fds[i] == this->_outFd)
+                    {
+                        _write_dest(data, length);
+                    }
+                    else
+                    {
+                        _write_fd(fds[i], data, length);
+                    }
+                }
+                catch (file_mover_err err)
+                {
+                    const std::lock_guard<std::mutex> guard(lock);
+                    errors[i] = err;
+                    changed.notify_all();
+                    return;
+                }
 
-    beforePosition = this->_outStream.tellp();
+                const std::lock_guard<std::mutex> guard(lock);
+                ++numSlotsWritten[i];
+                numBytesWritten[i] += length;
+                changed.notify_all();
+            }
+        });
+    }
 
-    if (this->_buff.buffered() > 0)
+    _hash_start();
+    while (true)
     {
-        if (!this->_firstWritten)
+        size_t slot;
         {
-            this->_buff.rotate_read_index();
-            this->_firstWritten = true;
+            std::unique_lock<std::mutex> guard(lock);
+            changed.wait(guard, [&]()
+            {
+                return (numSlotsFilled - slowest()) < lag;
+            });
+            slot = numSlotsFilled % this->_buff.ringLength;
         }
 
-        int numBytesBuffered = (
-                (this->_buff.buffered() >= this->_buff.bufferLength)
-                ? this->_buff.bufferLength
-                : this->_buff.buffered()
-            );
+        char* data = reinterpret_cast<char*>(this->_buff.ring[slot].data());
+        try
+        {
+            numBytesRead = _read_source(data, this->_buff.bytesPerBuffer);
+        }
+        catch (file_mover_err err)
+        {
+            readError = err;
+            numBytesRead = 0;
+        }
+        _hash_chunk(data, numBytesRead);
+        _digest_source(data, numBytesRead, this->_numBytesReadToBuffer);
 
-        char* bufferReadByte = reinterpret_cast<char*>(this->_buff.get_read_byte());
-        this->_outStream.write(bufferReadByte, numBytesBuffered);
-        afterPosition = this->_outStream.tellp();
-        numBytesWritten += (afterPosition - beforePosition);
-        this->_buff.rotate_partial_read(numBytesWritten);
-        this->_numBytesWrittenFromBuffer += numBytesWritten;
+        const std::lock_guard<std::mutex> guard(lock);
+        this->_numBytesReadToBuffer += numBytesRead;
+        if (numBytesRead)
+        {
+            this->_slotLengths[slot] = numBytesRead;
+            ++numSlotsFilled;
+        }
+        if (numBytesRead < this->_buff.bytesPerBuffer)
+        {
+            sourceEnded = true;
+            changed.notify_all();
+            break;
+        }
+        changed.notify_all();
     }
 
-    if (this->_outStream.is_open() && (afterPosition < beforePosition))
+    for (std::thread& writer: writers)
     {
-        this->_outStream.close();
+        writer.join();
     }
 
-    return numBytesWritten;
+    /* Account for each destination in the order it was opened */
+    size_t writer(0);
+    if (_dest_open()) this->_numBytesWrittenFromBuffer = numBytesWritten[writer++];
+    for (size_t i(0); i < this->_mirrorFds.size(); ++i)
+    {
+        if (this->_mirrorFds[i] >= 0) this->_mirrorBytesWritten[i] = numBytesWritten[writer++];
+    }
+
+    _close_fd(&(this->_inFd));
+    this->_inStream.close();
+    if (this->_buff.ringLength != ringLength)
+    {
+        this->_buff.set_size(this->_buff.bufferLength, ringLength);
+    }
+    if (readError) throw static_cast<file_mover_err>(readError);
+    for (int error: errors)
+    {
+        if (error) throw static_cast<file_mover_err>(error);
+    }
 }
 
-size_t FileCopy::write_processed_from_buffer()
+size_t FileCopy::finish()
 {
-    /* Writes data from the buffer out to the destination
-    only if it has been processed while in the buffer */
-    size_t beforePosition, afterPosition(0), numBytesWritten(0);
-    
-    if (!this->started) this->started = true;
-    if (!this->_outStream.is_open()) return 0;
-
-    beforePosition = this->_outStream.tellp();
+    /* Closes both files and returns the destination size */
+    if (this->_adaptive) _learn_geometry();
+    close();
+    _release_cache_tail();
+    get_dest_size();
 
-    if (this->_buff.processed() > 0)
+    if (this->_hashStarted)
     {
-        if (!this->_firstWritten)
-        {
-            this->_buff.rotate_read_index();
-            this->_firstWritten = true;
-        }
-
-        int numBytesBuffered = (
-                (this->_buff.processed() >= this->_buff.bufferLength)
-                ? this->_buff.bufferLength
-                : this->_buff.processed()
-            );
-
-        char* bufferReadByte = reinterpret_cast<char*>(this->_buff.get_read_byte());
-        this->_outStream.write(bufferReadByte, numBytesBuffered);
-        afterPosition = this->_outStream.tellp();
-        numBytesWritten += (afterPosition - beforePosition);
-        this->_buff.rotate_partial_read(numBytesWritten);
-        this->_numBytesWrittenFromBuffer += numBytesWritten;
+        this->_sourceChecksum = this->_hasher->finishHash();
+        this->_hashStarted = false;
     }
 
-    if (this->_outStream.is_open() && (afterPosition < beforePosition))
+    if (this->_resume && !this->_ranged)
     {
-        this->_outStream.close();
+        /* The destination is whole, so its checkpoint is stale */
+        std::error_code error;
+        std::filesystem::remove(_checkpoint_path(), error);
     }
 
-    return numBytesWritten;
+    #ifdef _DEBUG
+    if (!this->_ranged) _check_file_size_match();
+    std::cout << "Execute completed" << std::endl;
+    #endif
+
+    /* A range only accounts for its own bytes */
+    if (this->_ranged) return bytes_moved();
+
+    /* Return the actual file size */
+    return this->_destSizeInBytes;
 }
 
-void FileCopy::pre_buffer_source()
+bool FileCopy::prepare()
 {
-    while (this->_buff.available() && this->_inStream.is_open())
+    /* Readies an opened copy for its engine, whether execute() or
+    a shared io_uring queue runs it.  Returns false if there is
+    nothing left to move because the extents are shared. */
+    if (this->_reflink && !this->_ranged && clone())
     {
-        read_to_buffer();
+        /* FICLONE only shares whole files, so a range is always copied */
+        return false;
     }
+
+    /* Small files skip the ring buffer, so there is nothing to set up */
+    if (_small_file()) return true;
+
+    if (this->_adaptive) _apply_learned_geometry();
+    if (this->_rangeOffset && !this->_ranged) _hash_source_prefix();
+    _preallocate_dest();
+    return true;
 }
 
 size_t FileCopy::execute()
@@ -312,7 +3254,7 @@ size_t FileCopy::execute()
     _check_paths_not_empty();
     #endif
 
-    if (this->_destSizeInBytes && !this->_overwrite)
+    if (should_skip())
     {
         /* If destination file exists, skip it */
         #if _DEBUG
@@ -338,11 +3280,70 @@ size_t FileCopy::execute()
     /* Executes copy and blocks until transfer is complete */
     this->started = true;
 
-    pre_buffer_source();
-    while (!complete())
+    if (_mirrored())
     {
-        write_from_buffer();
-        read_to_buffer();
+        /* One read of the source feeds every destination */
+        _preallocate_dest();
+        _run_fan_out();
+        goto copyComplete;
+    }
+
+    if (!prepare())
+    {
+        goto copyComplete;
+    }
+
+    if (_small_file())
+    {
+        small_transfer();
+        goto copyComplete;
+    }
+
+    switch (_effective_engine())
+    {
+        case ENGINE_KERNEL:
+            while (ready())
+            {
+                kernel_transfer();
+            }
+            break;
+
+        case ENGINE_MMAP:
+            if (!_map_source())
+            {
+                _run_buffered();
+                break;
+            }
+            while (ready())
+            {
+                mmap_transfer();
+            }
+            break;
+
+        case ENGINE_POSITIONAL:
+            while (ready())
+            {
+                positional_transfer();
+            }
+            break;
+
+        case ENGINE_URING:
+            if (!_uring_ready())
+            {
+                /* Without io_uring the synchronous loop
+                works on the same descriptors */
+                _run_buffered();
+                break;
+            }
+            while (!uring_done())
+            {
+                uring_transfer();
+            }
+            break;
+
+        default:
+            _run_buffered();
+            break;
     }
 
     #if _DEBUG
@@ -352,14 +3353,149 @@ size_t FileCopy::execute()
     /* Jump to here if existing file was skipped */
     copyComplete:
 
-    close();
-    get_dest_size();
+    return finish();
+}
 
-    #ifdef _DEBUG
-    _check_file_size_match();
-    std::cout << "Execute completed" << std::endl;
-    #endif
+bool FileCopy::_read_block(int fd, char* data, size_t numBytes, size_t offset)
+{
+    /* Reads a whole block at offset.  Returns false on a
+    read error or if the file ends first. */
+    ssize_t numBytesRead;
+    size_t total(0);
+    while (total < numBytes)
+    {
+        numBytesRead = pread(fd, data + total, numBytes - total, offset + total);
+        if (numBytesRead < 0)
+        {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        if (!numBytesRead) return false;
+        total += numBytesRead;
+    }
+    return true;
+}
 
-    /* Return the actual file size */
-    return this->_destSizeInBytes;
+void FileCopy::_write_block(int fd, const char* data, size_t numBytes, size_t offset)
+{
+    ssize_t numBytesWritten;
+    size_t total(0);
+    while (total < numBytes)
+    {
+        numBytesWritten = pwrite(fd, data + total, numBytes - total, offset + total);
+        if (numBytesWritten < 0)
+        {
+            if (errno == EINTR) continue;
+            throw DEST_WRITE_FAILED;
+        }
+        total += numBytesWritten;
+    }
+}
+
+size_t FileCopy::repair(
+        std::filesystem::path sourcePath,
+        std::filesystem::path destPath,
+        const std::vector<block_digest>& digests
+    )
+{
+    /* Rewrites only the destination blocks that differ from the
+    source.  Each destination block is checked against the digest
+    recorded for it during the copy, or against the source block
+    read again if there is none.  A rewritten block is read back
+    from disk, and copied again if it still differs.
+    Returns the number of bytes rewritten. */
+    size_t blockSize(this->_digestBlockSize ? this->_digestBlockSize : BLOCK_DIGEST_SIZE);
+    size_t offset, length, block(0);
+    std::vector<char> sourceBlock(blockSize), destBlock(blockSize);
+    block_digest expected;
+    uint32_t digest;
+    unsigned attempt;
+
+    reset();
+    this->source = sourcePath;
+    this->dest = destPath;
+    _stat_source();
+
+    int sourceFd(::open(this->source.c_str(), O_RDONLY));
+    if (sourceFd < 0)
+    {
+        throw SOURCE_OPEN_FAILED;
+    }
+    int destFd(::open(this->dest.c_str(), O_RDWR | O_CREAT, 0666));
+    if (destFd < 0)
+    {
+        _close_fd(&sourceFd);
+        throw DEST_OPEN_FAILED;
+    }
+
+    try
+    {
+        /* A destination of the wrong size is cut or zero filled
+        to the source size, and its differing blocks fixed below */
+        if (ftruncate(destFd, get_source_size()) < 0)
+        {
+            throw DEST_WRITE_FAILED;
+        }
+
+        for (offset = 0; offset < get_source_size(); offset += length, ++block)
+        {
+            length = std::min(blockSize, get_source_size() - offset);
+            expected = (block < digests.size()) ? digests[block] : BLOCK_DIGEST_NONE;
+            if (expected == BLOCK_DIGEST_NONE)
+            {
+                if (!_read_block(sourceFd, sourceBlock.data(), length, offset))
+                {
+                    throw SOURCE_READ_FAILED;
+                }
+                expected = crc32c(0, sourceBlock.data(), length);
+            }
+            if (
+                    _read_block(destFd, destBlock.data(), length, offset)
+                    && (crc32c(0, destBlock.data(), length) == expected)
+                )
+            {
+                continue;
+            }
+
+            #if _DEBUG
+            std::cout << "Repairing block at " << offset << std::endl;
+            #endif
+
+            for (attempt = 0; ; ++attempt)
+            {
+                if (attempt == BLOCK_REPAIR_ATTEMPTS)
+                {
+                    throw BLOCK_REPAIR_FAILED;
+                }
+                if (!_read_block(sourceFd, sourceBlock.data(), length, offset))
+                {
+                    continue;
+                }
+                digest = crc32c(0, sourceBlock.data(), length);
+                _write_block(destFd, sourceBlock.data(), length, offset);
+
+                /* Read the block back from the disk, not the cache */
+                fdatasync(destFd);
+                posix_fadvise(destFd, offset, length, POSIX_FADV_DONTNEED);
+                if (
+                        _read_block(destFd, destBlock.data(), length, offset)
+                        && (crc32c(0, destBlock.data(), length) == digest)
+                    )
+                {
+                    break;
+                }
+            }
+            this->_numBytesWrittenFromBuffer += length;
+        }
+    }
+    catch (...)
+    {
+        _close_fd(&sourceFd);
+        _close_fd(&destFd);
+        throw;
+    }
+
+    _close_fd(&sourceFd);
+    _close_fd(&destFd);
+    return bytes_moved();
 }
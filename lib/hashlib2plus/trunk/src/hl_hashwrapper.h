@@ -75,6 +75,7 @@
 //----------------------------------------------------------------------	
 //STL includes
 #include <string>
+#include <algorithm>
 
 //----------------------------------------------------------------------	
 //C includes
@@ -155,6 +156,17 @@ class hashwrapper
 		 */  
 		virtual void resetContext(void) = 0;
 
+		/**
+		 *  @brief 	This method gives access to the raw
+		 *  		hash context, for saveState() and loadState()
+		 *
+		 *  		This memberfunction is pure virtual and
+		 *  		has to be implemented by the subclass
+		 *
+		 *  @param 	len Set to the size of the context in bytes
+		 *  @return 	a pointer to the context
+		 */  
+		virtual unsigned char* getContext(size_t *len) = 0;
 
 		/**
 		 * @brief 	This method should return the hash of the
@@ -281,6 +293,89 @@ class hashwrapper
 			fclose(file);
 			return(hashIt());
 		}
+
+		/**
+		 *  @brief 	This method starts an incremental hash
+		 *
+		 *  		Use it together with addData() and finishHash()
+		 *  		when the data arrives in pieces, for example
+		 *  		while it is being copied.
+		 */  
+		virtual void startHash(void)
+		{
+			resetContext();
+		}
+
+		/**
+		 *  @brief 	This method adds data to an incremental hash
+		 *
+		 *  @param 	data The data to add to the current context
+		 *  @param 	len The length of the data to add
+		 */  
+		virtual void addData(const unsigned char *data, size_t len)
+		{
+			/*
+			 * updateContext() takes an unsigned int,
+			 * so very large blocks are fed in pieces
+			 */
+			const size_t block = 1 << 30;
+			while(len > block)
+			{
+				updateContext((unsigned char*) data, block);
+				data += block;
+				len -= block;
+			}
+			updateContext((unsigned char*) data, len);
+		}
+
+		/**
+		 *  @brief 	This method finishes an incremental hash
+		 *
+		 *  @return 	the created hash as std::string
+		 */  
+		virtual std::string finishHash(void)
+		{
+			return(hashIt());
+		}
+
+		/**
+		 *  @brief 	This method saves the state of an
+		 *  		incremental hash
+		 *
+		 *  		The state can be stored and given to
+		 *  		loadState() later, even by another process
+		 *  		on the same machine, to carry on hashing
+		 *  		without feeding the earlier data again.
+		 *
+		 *  @return 	the raw hash context as std::string
+		 */  
+		virtual std::string saveState(void)
+		{
+			size_t len;
+			unsigned char *context = getContext(&len);
+			return std::string((const char*) context, len);
+		}
+
+		/**
+		 *  @brief 	This method restores an incremental hash
+		 *  		saved by saveState()
+		 *
+		 *  @param 	state The state returned by saveState()
+		 *  @throw	Throws a hlException if the state does
+		 *  		not belong to this kind of hash.
+		 */  
+		virtual void loadState(const std::string &state)
+		{
+			size_t len;
+			unsigned char *context = getContext(&len);
+			if(state.length() != len)
+			{
+				throw hlException(HL_UNKNOWN_SEE_MSG,
+						  "hashlib state-error: "
+						  "saved state does not match this hash.");
+			}
+			std::copy(state.begin(), state.end(), context);
+		}
 }; 
 
 //----------------------------------------------------------------------	
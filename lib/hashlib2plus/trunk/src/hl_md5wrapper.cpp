@@ -127,6 +127,19 @@ void md5wrapper::resetContext(void)
 	md5->MD5Init(&ctx);
 }
 
+/**
+ *  @brief 	This method gives access to the raw
+ *  		hash context
+ *
+ *  @param 	len Set to the size of the context in bytes
+ *  @return 	a pointer to the context
+ */  
+unsigned char* md5wrapper::getContext(size_t *len)
+{
+	*len = sizeof(ctx);
+	return (unsigned char*) &ctx;
+}
+
 /**
  * @brief 	This method should return the hash of the
  * 		test-string "The quick brown fox jumps over the lazy
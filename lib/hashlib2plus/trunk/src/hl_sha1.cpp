@@ -71,6 +71,14 @@
 //hashlib++ includes
 #include "hl_sha1.h"
 
+//---------------------------------------------------------------------- 
+//C includes
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
 
 //---------------------------------------------------------------------- 
 //defines
@@ -81,6 +89,193 @@
 #define SHA1CircularShift(bits,word) \
                 (((word) << (bits)) | ((word) >> (32-(bits))))
 
+//---------------------------------------------------------------------- 
+//hardware accelerated transforms
+
+#if defined(__x86_64__)
+
+/*
+ *  Byte order of the message words, big-endian in the block
+ */
+#define SHA1_WORD_MASK \
+		_mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL)
+
+/*
+ *  One group of four rounds with the SHA extensions.  Message
+ *  schedule vectors M[0..3] are reused in turn, each being
+ *  completed a few groups before it is needed.
+ */
+#define SHA1_NI_GROUP(i) \
+	if ((i) < 4) \
+	{ \
+		M[(i) % 4] = _mm_shuffle_epi8( \
+			_mm_loadu_si128((const __m128i*)(block + 16 * (i))), \
+			mask); \
+	} \
+	if ((i) == 0) \
+	{ \
+		E[0] = _mm_add_epi32(E[0], M[0]); \
+	} \
+	else \
+	{ \
+		E[(i) % 2] = _mm_sha1nexte_epu32(E[(i) % 2], M[(i) % 4]); \
+	} \
+	E[((i) + 1) % 2] = ABCD; \
+	if (((i) >= 3) && ((i) <= 18)) \
+	{ \
+		M[((i) + 1) % 4] = _mm_sha1msg2_epu32(M[((i) + 1) % 4], M[(i) % 4]); \
+	} \
+	ABCD = _mm_sha1rnds4_epu32(ABCD, E[(i) % 2], (i) / 5); \
+	if (((i) >= 1) && ((i) <= 16)) \
+	{ \
+		M[((i) + 3) % 4] = _mm_sha1msg1_epu32(M[((i) + 3) % 4], M[(i) % 4]); \
+	} \
+	if (((i) >= 2) && ((i) <= 17)) \
+	{ \
+		M[((i) + 2) % 4] = _mm_xor_si128(M[((i) + 2) % 4], M[(i) % 4]); \
+	}
+
+/**
+ *  @brief	Processes one block with the SHA extensions
+ *  @param	state The intermediate hash to update
+ *  @param	block The 64 byte message block
+ */  
+__attribute__((target("sha,sse4.1")))
+static void sha1_block_shani(hl_uint32 state[5], const hl_uint8* block)
+{
+	/* The extensions keep the first word in the top lane */
+	const __m128i mask =
+		_mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+	__m128i ABCD, ABCD_SAVE, E_SAVE, E[2], M[4];
+
+	ABCD = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)state), 0x1B);
+	E[0] = _mm_set_epi32(state[4], 0, 0, 0);
+	ABCD_SAVE = ABCD;
+	E_SAVE = E[0];
+
+	SHA1_NI_GROUP(0);  SHA1_NI_GROUP(1);  SHA1_NI_GROUP(2);  SHA1_NI_GROUP(3);
+	SHA1_NI_GROUP(4);  SHA1_NI_GROUP(5);  SHA1_NI_GROUP(6);  SHA1_NI_GROUP(7);
+	SHA1_NI_GROUP(8);  SHA1_NI_GROUP(9);  SHA1_NI_GROUP(10); SHA1_NI_GROUP(11);
+	SHA1_NI_GROUP(12); SHA1_NI_GROUP(13); SHA1_NI_GROUP(14); SHA1_NI_GROUP(15);
+	SHA1_NI_GROUP(16); SHA1_NI_GROUP(17); SHA1_NI_GROUP(18); SHA1_NI_GROUP(19);
+
+	E[0] = _mm_sha1nexte_epu32(E[0], E_SAVE);
+	ABCD = _mm_add_epi32(ABCD, ABCD_SAVE);
+
+	_mm_storeu_si128((__m128i*)state, _mm_shuffle_epi32(ABCD, 0x1B));
+	state[4] = _mm_extract_epi32(E[0], 3);
+}
+
+/**
+ *  @brief	Processes one block, expanding the message schedule
+ *  		four words at a time with AVX2 and running the
+ *  		rounds on the precomputed words
+ *  @param	state The intermediate hash to update
+ *  @param	block The 64 byte message block
+ */  
+__attribute__((target("avx2")))
+static void sha1_block_avx2(hl_uint32 state[5], const hl_uint8* block)
+{
+	const hl_uint32 K[] = { 0x5A827999, 0x6ED9EBA1, 0x8F1BBCDC, 0xCA62C1D6 };
+	alignas(16) hl_uint32 WK[80];
+	__m128i X[4], T, R;
+	hl_uint32 A, B, C, D, E, temp;
+	int t;
+
+	/*
+	 *  W[t] is the rotated xor of W[t-3], W[t-8], W[t-14] and
+	 *  W[t-16].  The last of four new words depends on the
+	 *  first, so it is computed without it and fixed up.
+	 */
+	for(t = 0; t < 16; t += 4)
+	{
+		X[t / 4] = _mm_shuffle_epi8(
+				_mm_loadu_si128((const __m128i*)(block + 4 * t)),
+				SHA1_WORD_MASK);
+		_mm_store_si128((__m128i*)(WK + t),
+				_mm_add_epi32(X[t / 4], _mm_set1_epi32(K[0])));
+	}
+	for(t = 16; t < 80; t += 4)
+	{
+		T = _mm_xor_si128(_mm_srli_si128(X[3], 4), X[2]);
+		T = _mm_xor_si128(T, _mm_alignr_epi8(X[1], X[0], 8));
+		T = _mm_xor_si128(T, X[0]);
+		R = _mm_or_si128(_mm_slli_epi32(T, 1), _mm_srli_epi32(T, 31));
+		T = _mm_slli_si128(R, 12);
+		R = _mm_xor_si128(R,
+				_mm_or_si128(_mm_slli_epi32(T, 1), _mm_srli_epi32(T, 31)));
+
+		X[0] = X[1];
+		X[1] = X[2];
+		X[2] = X[3];
+		X[3] = R;
+		_mm_store_si128((__m128i*)(WK + t),
+				_mm_add_epi32(R, _mm_set1_epi32(K[t / 20])));
+	}
+
+	A = state[0];
+	B = state[1];
+	C = state[2];
+	D = state[3];
+	E = state[4];
+
+	for(t = 0; t < 80; t++)
+	{
+		if (t < 20)
+		{
+			temp = (B & C) | ((~B) & D);
+		}
+		else if ((t >= 40) && (t < 60))
+		{
+			temp = (B & C) | (B & D) | (C & D);
+		}
+		else
+		{
+			temp = B ^ C ^ D;
+		}
+		temp += SHA1CircularShift(5,A) + E + WK[t];
+		E = D;
+		D = C;
+		C = SHA1CircularShift(30,B);
+		B = A;
+		A = temp;
+	}
+
+	state[0] += A;
+	state[1] += B;
+	state[2] += C;
+	state[3] += D;
+	state[4] += E;
+}
+
+/**
+ *  @brief	Processes one block with the fastest transform the
+ *  		CPU supports, chosen once at runtime
+ *  @param	state The intermediate hash to update
+ *  @param	block The 64 byte message block
+ *  @return	false when only the portable transform will do
+ */  
+static bool sha1_block_accelerated(hl_uint32 state[5], const hl_uint8* block)
+{
+	static const bool hasShaNi =
+		__builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1");
+	static const bool hasAvx2 = __builtin_cpu_supports("avx2");
+
+	if (hasShaNi)
+	{
+		sha1_block_shani(state, block);
+		return true;
+	}
+	if (hasAvx2)
+	{
+		sha1_block_avx2(state, block);
+		return true;
+	}
+	return false;
+}
+
+#endif
+
 //----------------------------------------------------------------------
 //private member-functions
 
@@ -172,6 +367,15 @@ void SHA1::SHA1ProcessMessageBlock(HL_SHA1_CTX *context)
 	hl_uint32      W[80];             /* Word sequence               */
 	hl_uint32      A, B, C, D, E;     /* Word buffers                */
 
+#if defined(__x86_64__)
+	if (sha1_block_accelerated(context->Intermediate_Hash,
+				   context->Message_Block))
+	{
+		context->Message_Block_Index = 0;
+		return;
+	}
+#endif
+
 	/*
 	 *  Initialize the first 16 words in the array W
 	 */
@@ -311,13 +515,23 @@ int SHA1::SHA1Input(    HL_SHA1_CTX    *context,
 	{
 		return context->Corrupted;
 	}
-	while(length-- && !context->Corrupted)
+	/*
+	 *  Fill the message block as far as the data allows,
+	 *  rather than a byte at a time
+	 */
+	while(length && !context->Corrupted)
 	{
-		context->Message_Block[context->Message_Block_Index++] =
-			(*message_array & 0xFF);
+		unsigned int count = 64 - context->Message_Block_Index;
+		if (count > length)
+		{
+			count = length;
+		}
+		memcpy(context->Message_Block + context->Message_Block_Index,
+		       message_array, count);
+		context->Message_Block_Index += count;
 
-		context->Length_Low += 8;
-		if (context->Length_Low == 0)
+		context->Length_Low += count * 8;
+		if (context->Length_Low < count * 8)
 		{
 			context->Length_High++;
 			if (context->Length_High == 0)
@@ -332,7 +546,8 @@ int SHA1::SHA1Input(    HL_SHA1_CTX    *context,
 			SHA1ProcessMessageBlock(context);
 		}
 
-		message_array++;
+		message_array += count;
+		length -= count;
 	}
 
 	return shaSuccess;
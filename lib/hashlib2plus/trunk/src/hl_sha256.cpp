@@ -82,6 +82,11 @@
 //---------------------------------------------------------------------- 
 #include "hl_sha2mac.h"
 
+/* After the library's own endian macros, which glibc's would clash with */
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
 //---------------------------------------------------------------------- 
 
 /*
@@ -127,6 +132,178 @@ const static sha2_word32 sha256_initial_hash_value[8] = {
  */
 static const char *sha2_hex_digits = "0123456789abcdef";
 
+/*** HARDWARE ACCELERATED TRANSFORMS: *********************************/
+
+#if defined(__x86_64__)
+
+/*
+ * Byte order of the message words, big-endian in the block:
+ */
+#define SHA256_WORD_MASK \
+	_mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL)
+
+/*
+ * One group of four rounds with the SHA extensions.  Message schedule
+ * vectors M[0..3] are reused in turn, each being completed a few
+ * groups before it is needed.
+ */
+#define SHA256_NI_GROUP(i) \
+	if ((i) < 4) { \
+		M[(i) % 4] = _mm_shuffle_epi8( \
+			_mm_loadu_si128((const __m128i*)(data + 4 * (i))), \
+			SHA256_WORD_MASK); \
+	} \
+	MSG = _mm_add_epi32(M[(i) % 4], \
+			    _mm_loadu_si128((const __m128i*)(K256 + 4 * (i)))); \
+	STATE1 = _mm_sha256rnds2_epu32(STATE1, STATE0, MSG); \
+	if ((i) >= 3 && (i) <= 14) { \
+		TMP = _mm_alignr_epi8(M[(i) % 4], M[((i) + 3) % 4], 4); \
+		M[((i) + 1) % 4] = _mm_add_epi32(M[((i) + 1) % 4], TMP); \
+		M[((i) + 1) % 4] = _mm_sha256msg2_epu32(M[((i) + 1) % 4], M[(i) % 4]); \
+	} \
+	MSG = _mm_shuffle_epi32(MSG, 0x0E); \
+	STATE0 = _mm_sha256rnds2_epu32(STATE0, STATE1, MSG); \
+	if ((i) >= 1 && (i) <= 12) { \
+		M[((i) + 3) % 4] = _mm_sha256msg1_epu32(M[((i) + 3) % 4], M[(i) % 4]); \
+	}
+
+/**
+ *  @brief 	Transforms one block with the SHA extensions
+ *  @param	state The intermediate hash to update
+ *  @param	data The block to transform
+ */  
+__attribute__((target("sha,sse4.1")))
+static void sha256_transform_shani(sha2_word32 state[8], const sha2_word32* data) {
+	__m128i	STATE0, STATE1, ABEF_SAVE, CDGH_SAVE, MSG, TMP, M[4];
+
+	/* The extensions want the state as ABEF and CDGH */
+	TMP = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[0]), 0xB1);
+	STATE1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[4]), 0x1B);
+	STATE0 = _mm_alignr_epi8(TMP, STATE1, 8);
+	STATE1 = _mm_blend_epi16(STATE1, TMP, 0xF0);
+	ABEF_SAVE = STATE0;
+	CDGH_SAVE = STATE1;
+
+	SHA256_NI_GROUP(0);  SHA256_NI_GROUP(1);  SHA256_NI_GROUP(2);  SHA256_NI_GROUP(3);
+	SHA256_NI_GROUP(4);  SHA256_NI_GROUP(5);  SHA256_NI_GROUP(6);  SHA256_NI_GROUP(7);
+	SHA256_NI_GROUP(8);  SHA256_NI_GROUP(9);  SHA256_NI_GROUP(10); SHA256_NI_GROUP(11);
+	SHA256_NI_GROUP(12); SHA256_NI_GROUP(13); SHA256_NI_GROUP(14); SHA256_NI_GROUP(15);
+
+	STATE0 = _mm_add_epi32(STATE0, ABEF_SAVE);
+	STATE1 = _mm_add_epi32(STATE1, CDGH_SAVE);
+
+	/* Back to ABCD and EFGH */
+	TMP = _mm_shuffle_epi32(STATE0, 0x1B);
+	STATE1 = _mm_shuffle_epi32(STATE1, 0xB1);
+	STATE0 = _mm_blend_epi16(TMP, STATE1, 0xF0);
+	STATE1 = _mm_alignr_epi8(STATE1, TMP, 8);
+	_mm_storeu_si128((__m128i*)&state[0], STATE0);
+	_mm_storeu_si128((__m128i*)&state[4], STATE1);
+}
+
+/* Vector forms of the message schedule functions: */
+#define VROTR32(b,x)	_mm_or_si128(_mm_srli_epi32((x), (b)), _mm_slli_epi32((x), 32 - (b)))
+#define vsigma0_256(x)	_mm_xor_si128(_mm_xor_si128(VROTR32(7, (x)), VROTR32(18, (x))), _mm_srli_epi32((x), 3))
+#define vsigma1_256(x)	_mm_xor_si128(_mm_xor_si128(VROTR32(17, (x)), VROTR32(19, (x))), _mm_srli_epi32((x), 10))
+
+/**
+ *  @brief 	Transforms one block, expanding the message schedule four
+ *  		words at a time with AVX2 and running the rounds on the
+ *  		precomputed words
+ *  @param	state The intermediate hash to update
+ *  @param	data The block to transform
+ */  
+__attribute__((target("avx2")))
+static void sha256_transform_avx2(sha2_word32 state[8], const sha2_word32* data) {
+	alignas(16) sha2_word32	WK[64];
+	sha2_word32	a, b, c, d, e, f, g, h, T1, T2;
+	__m128i		X[4], W, S;
+	int		j;
+
+	for (j = 0; j < 16; j += 4) {
+		X[j / 4] = _mm_shuffle_epi8(
+			_mm_loadu_si128((const __m128i*)(data + j)), SHA256_WORD_MASK);
+		_mm_store_si128((__m128i*)(WK + j), _mm_add_epi32(X[j / 4],
+				_mm_loadu_si128((const __m128i*)(K256 + j))));
+	}
+
+	/*
+	 * W[j] needs sigma1 of W[j-2], so the four new words are
+	 * finished two at a time:
+	 */
+	for (j = 16; j < 64; j += 4) {
+		W = _mm_add_epi32(X[0], vsigma0_256(_mm_alignr_epi8(X[1], X[0], 4)));
+		W = _mm_add_epi32(W, _mm_alignr_epi8(X[3], X[2], 4));
+		S = vsigma1_256(_mm_shuffle_epi32(X[3], 0x4E));
+		W = _mm_add_epi32(W, _mm_blend_epi32(_mm_setzero_si128(), S, 0x3));
+		S = vsigma1_256(_mm_shuffle_epi32(W, 0x4E));
+		W = _mm_add_epi32(W, _mm_blend_epi32(_mm_setzero_si128(), S, 0xC));
+
+		X[0] = X[1];
+		X[1] = X[2];
+		X[2] = X[3];
+		X[3] = W;
+		_mm_store_si128((__m128i*)(WK + j), _mm_add_epi32(W,
+				_mm_loadu_si128((const __m128i*)(K256 + j))));
+	}
+
+	a = state[0];
+	b = state[1];
+	c = state[2];
+	d = state[3];
+	e = state[4];
+	f = state[5];
+	g = state[6];
+	h = state[7];
+
+	for (j = 0; j < 64; j++) {
+		T1 = h + Sigma1_256(e) + Ch(e, f, g) + WK[j];
+		T2 = Sigma0_256(a) + Maj(a, b, c);
+		h = g;
+		g = f;
+		f = e;
+		e = d + T1;
+		d = c;
+		c = b;
+		b = a;
+		a = T1 + T2;
+	}
+
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+	state[4] += e;
+	state[5] += f;
+	state[6] += g;
+	state[7] += h;
+}
+
+/**
+ *  @brief 	Transforms one block with the fastest transform the CPU
+ *  		supports, chosen once at runtime
+ *  @param	state The intermediate hash to update
+ *  @param	data The block to transform
+ *  @return	false when only the portable transform will do
+ */  
+static bool sha256_transform_accelerated(sha2_word32 state[8], const sha2_word32* data) {
+	static const bool hasShaNi =
+		__builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1");
+	static const bool hasAvx2 = __builtin_cpu_supports("avx2");
+
+	if (hasShaNi) {
+		sha256_transform_shani(state, data);
+		return true;
+	}
+	if (hasAvx2) {
+		sha256_transform_avx2(state, data);
+		return true;
+	}
+	return false;
+}
+
+#endif /* __x86_64__ */
+
 /*** SHA-256: *********************************************************/
 
 /**
@@ -189,6 +366,12 @@ void SHA256::SHA256_Transform(HL_SHA256_CTX* context, const sha2_word32* data) {
 	sha2_word32	T1, *W256;
 	int		j;
 
+#if defined(__x86_64__)
+	if (sha256_transform_accelerated(context->state, data)) {
+		return;
+	}
+#endif
+
 	W256 = (sha2_word32*)context->buffer;
 
 	/* Initialize registers with the prev. intermediate value */
@@ -252,6 +435,12 @@ void SHA256::SHA256_Transform(HL_SHA256_CTX* context, const sha2_word32* data) {
 	sha2_word32	T1, T2, *W256;
 	int		j;
 
+#if defined(__x86_64__)
+	if (sha256_transform_accelerated(context->state, data)) {
+		return;
+	}
+#endif
+
 	W256 = (sha2_word32*)context->buffer;
 
 	/* Initialize registers with the prev. intermediate value */
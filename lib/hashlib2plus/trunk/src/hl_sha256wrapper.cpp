@@ -101,6 +101,19 @@ void sha256wrapper::resetContext(void)
 	sha256->SHA256_Init(&context);
 }
 
+/**
+ *  @brief 	This method gives access to the raw
+ *  		hash context
+ *
+ *  @param 	len Set to the size of the context in bytes
+ *  @return 	a pointer to the context
+ */  
+unsigned char* sha256wrapper::getContext(size_t *len)
+{
+	*len = sizeof(context);
+	return (unsigned char*) &context;
+}
+
 
 /**
  * @brief 	This method should return the hash of the
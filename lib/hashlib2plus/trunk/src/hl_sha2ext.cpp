@@ -78,6 +78,11 @@
 #include "hl_sha2ext.h"
 #include "hl_sha2mac.h"
 
+/* After the library's own endian macros, which glibc's would clash with */
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
 //---------------------------------------------------------------------- 
 
 /* Hash constant words K for SHA-384 and SHA-512: */
@@ -156,6 +161,118 @@ static const char *sha2_hex_digits = "0123456789abcdef";
 
 //----------------------------------------------------------------------
 
+/*** HARDWARE ACCELERATED TRANSFORMS: *********************************/
+
+#if defined(__x86_64__)
+
+/* Byte order of the message words, big-endian in the block: */
+#define SHA512_WORD_MASK \
+	_mm256_set_epi64x(0x08090a0b0c0d0e0fULL, 0x0001020304050607ULL, \
+			  0x08090a0b0c0d0e0fULL, 0x0001020304050607ULL)
+
+/* Vector forms of the message schedule functions: */
+#define VROTR64(b,x)	_mm256_or_si256(_mm256_srli_epi64((x), (b)), _mm256_slli_epi64((x), 64 - (b)))
+#define vsigma0_512(x)	_mm256_xor_si256(_mm256_xor_si256(VROTR64( 1, (x)), VROTR64( 8, (x))), _mm256_srli_epi64((x), 7))
+#define vsigma1_512(x)	_mm256_xor_si256(_mm256_xor_si256(VROTR64(19, (x)), VROTR64(61, (x))), _mm256_srli_epi64((x), 6))
+
+/* Words 1 to 3 of lo followed by word 0 of hi: */
+#define VALIGN64(hi,lo) \
+	_mm256_alignr_epi8(_mm256_permute2x128_si256((lo), (hi), 0x21), (lo), 8)
+
+/**
+ *  @brief 	Transforms one block, expanding the message schedule four
+ *  		words at a time with AVX2 and running the rounds on the
+ *  		precomputed words
+ *  @param	state The intermediate hash to update
+ *  @param	data The block to transform
+ */  
+__attribute__((target("avx2")))
+static void sha512_transform_avx2(sha2_word64 state[8], const sha2_word64* data) {
+	alignas(32) sha2_word64	WK[80];
+	sha2_word64	a, b, c, d, e, f, g, h, T1, T2;
+	__m256i		X[4], W, S;
+	int		j;
+
+	for (j = 0; j < 16; j += 4) {
+		X[j / 4] = _mm256_shuffle_epi8(
+			_mm256_loadu_si256((const __m256i*)(data + j)), SHA512_WORD_MASK);
+		_mm256_store_si256((__m256i*)(WK + j), _mm256_add_epi64(X[j / 4],
+				_mm256_loadu_si256((const __m256i*)(K512 + j))));
+	}
+
+	/*
+	 * W[j] needs sigma1 of W[j-2], so the four new words are
+	 * finished two at a time:
+	 */
+	for (j = 16; j < 80; j += 4) {
+		W = _mm256_add_epi64(X[0], vsigma0_512(VALIGN64(X[1], X[0])));
+		W = _mm256_add_epi64(W, VALIGN64(X[3], X[2]));
+		S = vsigma1_512(_mm256_permute4x64_epi64(X[3], 0x4E));
+		W = _mm256_add_epi64(W, _mm256_blend_epi32(_mm256_setzero_si256(), S, 0x0F));
+		S = vsigma1_512(_mm256_permute4x64_epi64(W, 0x4E));
+		W = _mm256_add_epi64(W, _mm256_blend_epi32(_mm256_setzero_si256(), S, 0xF0));
+
+		X[0] = X[1];
+		X[1] = X[2];
+		X[2] = X[3];
+		X[3] = W;
+		_mm256_store_si256((__m256i*)(WK + j), _mm256_add_epi64(W,
+				_mm256_loadu_si256((const __m256i*)(K512 + j))));
+	}
+
+	a = state[0];
+	b = state[1];
+	c = state[2];
+	d = state[3];
+	e = state[4];
+	f = state[5];
+	g = state[6];
+	h = state[7];
+
+	for (j = 0; j < 80; j++) {
+		T1 = h + Sigma1_512(e) + Ch(e, f, g) + WK[j];
+		T2 = Sigma0_512(a) + Maj(a, b, c);
+		h = g;
+		g = f;
+		f = e;
+		e = d + T1;
+		d = c;
+		c = b;
+		b = a;
+		a = T1 + T2;
+	}
+
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+	state[4] += e;
+	state[5] += f;
+	state[6] += g;
+	state[7] += h;
+}
+
+/**
+ *  @brief 	Transforms one block with the fastest transform the CPU
+ *  		supports, chosen once at runtime
+ *  @param	state The intermediate hash to update
+ *  @param	data The block to transform
+ *  @return	false when only the portable transform will do
+ */  
+static bool sha512_transform_accelerated(sha2_word64 state[8], const sha2_word64* data) {
+	static const bool hasAvx2 = __builtin_cpu_supports("avx2");
+
+	if (hasAvx2) {
+		sha512_transform_avx2(state, data);
+		return true;
+	}
+	return false;
+}
+
+#endif /* __x86_64__ */
+
+//----------------------------------------------------------------------
+
 /**
  *  @brief 	Initialize the SHA512 context
  *  @param	context The context to init.
@@ -216,6 +333,12 @@ void SHA2ext::SHA512_Transform(HL_SHA512_CTX* context, const sha2_word64* data)
 	sha2_word64	T1, *W512 = (sha2_word64*)context->buffer;
 	int		j;
 
+#if defined(__x86_64__)
+	if (sha512_transform_accelerated(context->state, data)) {
+		return;
+	}
+#endif
+
 	/* Initialize registers with the prev. intermediate value */
 	a = context->state[0];
 	b = context->state[1];
@@ -276,6 +399,12 @@ void SHA2ext::SHA512_Transform(HL_SHA512_CTX* context, const sha2_word64* data)
 	sha2_word64	T1, T2, *W512 = (sha2_word64*)context->buffer;
 	int		j;
 
+#if defined(__x86_64__)
+	if (sha512_transform_accelerated(context->state, data)) {
+		return;
+	}
+#endif
+
 	/* Initialize registers with the prev. intermediate value */
 	a = context->state[0];
 	b = context->state[1];
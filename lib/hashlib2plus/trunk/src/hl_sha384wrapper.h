@@ -115,6 +115,15 @@ class sha384wrapper : public hashwrapper
 			 */  
 			virtual void resetContext(void);
 
+			/**
+			 *  @brief 	This method gives access to the raw
+			 *  		hash context
+			 *
+			 *  @param 	len Set to the size of the context in bytes
+			 *  @return 	a pointer to the context
+			 */  
+			virtual unsigned char* getContext(size_t *len);
+
 			/**
 			 * @brief 	This method should return the hash of the
 			 * 		test-string "The quick brown fox jumps over the lazy
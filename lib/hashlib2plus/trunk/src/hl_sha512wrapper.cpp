@@ -98,6 +98,19 @@ void sha512wrapper::resetContext(void)
 	sha512->SHA512_Init(&context);
 }
 
+/**
+ *  @brief 	This method gives access to the raw
+ *  		hash context
+ *
+ *  @param 	len Set to the size of the context in bytes
+ *  @return 	a pointer to the context
+ */  
+unsigned char* sha512wrapper::getContext(size_t *len)
+{
+	*len = sizeof(context);
+	return (unsigned char*) &context;
+}
+
 /**
  * @brief 	This method should return the hash of the
  * 		test-string "The quick brown fox jumps over the lazy
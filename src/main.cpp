@@ -195,6 +195,9 @@ int main(int argc, char** argv)
     //     t._threads[i].join();
     // }
 
+    /* Simultaneous file copy, verifying each file once written */
+    // t.copy_and_verify(4);
+
     /* Single threaded hashing */
     // t.verify();
 
@@ -4,15 +4,51 @@ TreeSlinger::TreeSlinger() :
 _sourceHashed(false),
 _destHashed(false),
 _hashInline(true),
+_reflink(false),
+_direct(false),
+_threaded(false),
+_sparse(false),
+_preallocate(true),
+_adaptive(false),
+_resume(false),
+_deviceAware(true),
+_largestFirst(true),
 _parentPathLength(0),
+_queueDepth(4),
+_extentHint(0),
+_cachePolicy(CACHE_KEEP),
+_smallFileThreshold(SMALL_FILE_THRESHOLD),
+_chunkSize(RING_BUFFER_CHUNKSIZE),
+_ringDepth(RING_BUFFER_DEPTH),
+_splitThreshold(SPLIT_FILE_THRESHOLD),
+_splitRangeSize(SPLIT_RANGE_SIZE),
+_checkpointInterval(RESUME_CHECKPOINT_INTERVAL),
+_skipPolicy(SKIP_EXISTS),
+_blockDigestSize(BLOCK_DIGEST_SIZE),
+_mirrorLag(MIRROR_LAG_SLOTS),
+_rotationalStreams(ROTATIONAL_DEVICE_STREAMS),
+_solidStateStreams(SOLID_STATE_DEVICE_STREAMS),
+_smallFileWorkers(SMALL_FILE_WORKERS),
+_engine(ENGINE_STREAM),
 _size(0),
 _transferred(0),
 _sourceQueueIndex(0),
-_destQueueIndex(0)
+_destQueueIndex(0),
+_nextLane(0),
+_numUnclaimed(0),
+_predictedMakespan(0),
+_predictedSpread(0),
+_laneStats(),
+_pipelined(false),
+_copiersDone(false)
 {
     this->_destFiles = new std::vector<std::filesystem::path>();
     this->_sourceChecksums = new std::vector<std::string>();
     this->_destChecksums = new std::vector<std::string>();
+    this->_bytesMoved = new std::vector<size_t>();
+    this->_mirrorBytesMoved = new std::vector<std::vector<size_t>>();
+    this->_copyErrors = new std::vector<int>();
+    this->_blockDigests = new std::vector<std::vector<block_digest>>();
 }
 
 TreeSlinger::~TreeSlinger()
@@ -20,6 +56,10 @@ TreeSlinger::~TreeSlinger()
     delete this->_destFiles;
     delete this->_sourceChecksums;
     delete this->_destChecksums;
+    delete this->_bytesMoved;
+    delete this->_mirrorBytesMoved;
+    delete this->_copyErrors;
+    delete this->_blockDigests;
     // for (FileCopy& copier: this->_copiers)
     // {
     //     copier.close();
@@ -37,6 +77,19 @@ void TreeSlinger::reset()
     this->_destQueueIndex = 0;
     this->_size = 0;
     this->_transferred = 0;
+    this->_splitFiles.clear();
+    this->_lanes.clear();
+    this->_fileLanes.clear();
+    this->_devices.clear();
+    this->_workQueues.clear();
+    this->_fileSizes.clear();
+    this->_nextLane = 0;
+    this->_numUnclaimed = 0;
+    this->_predictedMakespan = 0;
+    this->_predictedSpread = 0;
+    this->_laneStats[0] = LaneStats();
+    this->_laneStats[1] = LaneStats();
+    this->_completedFiles.clear();
     delete this->_destFiles;
     this->_destFiles = new std::vector<std::filesystem::path>();
     _reset_copiers();
@@ -58,6 +111,13 @@ void TreeSlinger::reset()
         this->_sourceChecksums->at(i) = std::string();
         this->_destChecksums->at(i) = std::string();
     }
+    for (size_t& numBytes: *(this->_bytesMoved))
+    {
+        numBytes = 0;
+    }
+    this->_mirrorBytesMoved->clear();
+    this->_copyErrors->clear();
+    this->_blockDigests->clear();
     
     /*
     - reset progress
@@ -145,6 +205,32 @@ inline std::filesystem::path TreeSlinger::_get_relative_dest(
     return std::filesystem::path(redirected).lexically_normal();
 }
 
+void TreeSlinger::_configure_copier(FileCopy* copier)
+{
+    /* Applies the job settings to a copier */
+    copier->set_reflink(this->_reflink);
+    copier->set_direct(this->_direct);
+    copier->set_threaded(this->_threaded);
+    copier->set_sparse(this->_sparse);
+    copier->set_preallocate(this->_preallocate);
+    copier->set_extent_hint(this->_extentHint);
+    copier->set_cache_policy(this->_cachePolicy);
+    copier->set_small_file_threshold(this->_smallFileThreshold);
+    copier->set_engine(this->_engine);
+    copier->set_queue_depth(this->_queueDepth);
+    copier->set_ring_depth(this->_ringDepth);
+    copier->set_chunk_size(this->_chunkSize);
+    copier->set_adaptive_geometry(this->_adaptive);
+    copier->set_resume(this->_resume);
+    copier->set_checkpoint_interval(this->_checkpointInterval);
+    copier->set_skip_policy(this->_skipPolicy);
+    copier->set_block_digest_size(this->_blockDigestSize);
+    copier->set_mirror_lag(this->_mirrorLag);
+    copier->set_hash_algorithm(
+            this->_hashInline ? this->algorithm.c_str() : ""
+        );
+}
+
 void TreeSlinger::_create_copiers(int num)
 {
     #if _DEBUG
@@ -158,6 +244,7 @@ void TreeSlinger::_create_copiers(int num)
     for (int i(0); i < num; ++i)
     {
         this->_copiers.emplace_back(FileCopy());
+        _configure_copier(&(this->_copiers.back()));
     }
 }
 
@@ -176,22 +263,585 @@ void TreeSlinger::_reset_copiers()
 
 int TreeSlinger::_get_next_source_index()
 {
-    const std::lock_guard<std::mutex> lock(this->_sourceQueueLock);
     return this->_sourceQueueIndex++;
 }
 
+unsigned TreeSlinger::_device_streams(dev_t device)
+{
+    /* Looks the device up in sysfs to see whether it spins.
+    A partition keeps its queue settings on the parent disk.
+    Devices without a queue, like tmpfs or network mounts, are
+    treated as solid state. */
+    std::string block(
+            "/sys/dev/block/"
+            + std::to_string(major(device)) + ":"
+            + std::to_string(minor(device))
+        );
+    char rotational('0');
+
+    for (const char* queue: {"/queue/rotational", "/../queue/rotational"})
+    {
+        std::ifstream flag(block + queue);
+        if (flag >> rotational) break;
+    }
+    return (rotational == '1') ? this->_rotationalStreams : this->_solidStateStreams;
+}
+
+void TreeSlinger::_group_by_device()
+{
+    /* Sorts the files into lanes by the devices they are read
+    from and written to, so copiers can run on different volumes
+    at once while each device only sees as many streams as it
+    allows.  Without device awareness everything shares one
+    unlimited lane.  Small files get lanes of their own when they
+    have their own copiers.  Each lane is then ordered largest
+    first. */
+    std::map<std::pair<std::vector<dev_t>, bool>, size_t> laneIndexes;
+    std::vector<std::filesystem::path>* sources = this->_gatherer.get();
+    struct stat status;
+
+    this->_lanes.clear();
+    this->_devices.clear();
+    this->_fileLanes.assign(sources->size(), 0);
+    this->_fileSizes.assign(sources->size(), 0);
+    this->_nextLane = 0;
+    this->_numUnclaimed = sources->size();
+
+    for (size_t index(0); index < sources->size(); ++index)
+    {
+        std::vector<dev_t> devices;
+        bool found(::stat(sources->at(index).c_str(), &status) == 0);
+        if (found) this->_fileSizes[index] = status.st_size;
+        if (this->_deviceAware)
+        {
+            if (found) devices.push_back(status.st_dev);
+            std::filesystem::path destDir(this->_destFiles->at(index).parent_path());
+            if (::stat(destDir.c_str(), &status) == 0)
+            {
+                devices.push_back(status.st_dev);
+            }
+            for (size_t mirror(0); mirror < this->_mirrorRoots.size(); ++mirror)
+            {
+                std::filesystem::path mirrorDir(_get_mirror_dest(mirror, destDir));
+                if (::stat(mirrorDir.c_str(), &status) == 0)
+                {
+                    devices.push_back(status.st_dev);
+                }
+            }
+            std::sort(devices.begin(), devices.end());
+            devices.erase(std::unique(devices.begin(), devices.end()), devices.end());
+        }
+
+        bool small(_small_lanes() && _is_small_file(index));
+        auto lane = laneIndexes.find({devices, small});
+        if (lane == laneIndexes.end())
+        {
+            lane = laneIndexes.emplace(
+                    std::make_pair(devices, small),
+                    this->_lanes.size()
+                ).first;
+            this->_lanes.push_back(DeviceLane{devices, {}, 0, 0, false, small});
+            for (dev_t device: devices)
+            {
+                if (!this->_devices.count(device))
+                {
+                    this->_devices[device] = DeviceSlots{_device_streams(device), 0};
+                }
+            }
+        }
+        this->_lanes[lane->second].indexes.push_back(index);
+        this->_fileLanes[index] = lane->second;
+    }
+
+    for (DeviceLane& lane: this->_lanes)
+    {
+        for (dev_t device: lane.devices)
+        {
+            if (this->_devices[device].limit) lane.limited = true;
+        }
+        if (this->_largestFirst)
+        {
+            std::stable_sort(
+                    lane.indexes.begin(),
+                    lane.indexes.end(),
+                    [this](size_t a, size_t b)
+                    {
+                        return this->_fileSizes[a] > this->_fileSizes[b];
+                    }
+                );
+        }
+        lane.end = lane.indexes.size();
+    }
+    this->_workQueues = std::vector<WorkQueue>(_num_copiers());
+    _predict_completion();
+}
+
+void TreeSlinger::_predict_completion()
+{
+    /* Plays the lanes out in claim order, each file going to
+    whichever of the lane's streams frees up first, to predict
+    how far apart the copiers will finish.  The spread is the gap
+    in bytes between the busiest stream and the idlest, across
+    the lane where it is widest. */
+    this->_predictedMakespan = 0;
+    this->_predictedSpread = 0;
+
+    for (const DeviceLane& lane: this->_lanes)
+    {
+        size_t numStreams(std::max(_num_copiers(), 1));
+        for (dev_t device: lane.devices)
+        {
+            unsigned limit(this->_devices[device].limit);
+            if (limit) numStreams = std::min(numStreams, static_cast<size_t>(limit));
+        }
+
+        std::priority_queue<size_t, std::vector<size_t>, std::greater<size_t>> loads;
+        for (size_t stream(0); stream < numStreams; ++stream)
+        {
+            loads.push(0);
+        }
+        for (size_t index: lane.indexes)
+        {
+            size_t load(loads.top());
+            loads.pop();
+            loads.push(load + this->_fileSizes[index]);
+        }
+
+        size_t first(loads.top()), last(first);
+        while (!loads.empty())
+        {
+            last = loads.top();
+            loads.pop();
+        }
+        this->_predictedMakespan = std::max(this->_predictedMakespan, last);
+        this->_predictedSpread = std::max(this->_predictedSpread, last - first);
+    }
+
+    #if _DEBUG
+    std::cout << "Predicted completion spread " << this->_predictedSpread;
+    std::cout << " of " << this->_predictedMakespan << " bytes" << std::endl;
+    #endif
+}
+
+bool TreeSlinger::_lane_limited(size_t lane)
+{
+    /* Whether any device a lane touches limits its streams */
+    return this->_lanes[lane].limited;
+}
+
+int TreeSlinger::_worker_lane(size_t worker)
+{
+    /* Which lanes a copier serves: the last few take the small
+    file lanes and the rest the large ones, or -1 for any lane
+    when there are too few copiers to keep them apart */
+    if (!_small_lanes()) return -1;
+    return (worker >= _num_copiers() - this->_smallFileWorkers) ? 1 : 0;
+}
+
+bool TreeSlinger::_small_lanes()
+{
+    /* Whether small files are given lanes and copiers of their own */
+    return (
+            this->_smallFileWorkers
+            && this->_smallFileThreshold
+            && (static_cast<unsigned>(_num_copiers()) > this->_smallFileWorkers)
+        );
+}
+
+bool TreeSlinger::_is_small_file(size_t index)
+{
+    return (
+            this->_smallFileThreshold
+            && (this->_fileSizes[index] <= this->_smallFileThreshold)
+        );
+}
+
+bool TreeSlinger::_lanes_drained(int small)
+{
+    /* Whether every lane of a kind has handed out all its files.
+    The caller holds the source queue lock. */
+    for (const DeviceLane& lane: this->_lanes)
+    {
+        if ((small < 0) || (lane.small == static_cast<bool>(small)))
+        {
+            if (lane.next < lane.end) return false;
+        }
+    }
+    return true;
+}
+
+bool TreeSlinger::_claim_file(size_t worker, size_t* index, bool wait)
+{
+    /* Takes the next file for a copier.  Its own queue is tried
+    first, then the lanes, starting after the last lane served so
+    different volumes take turns, then the queues of the other
+    copiers.  Copiers keep to the lanes of their own kind, small or
+    large, until those are drained.  From a lane whose devices are
+    unlimited a batch is claimed, shrinking as the lane empties,
+    and the rest queued.  A batch is the largest file left plus the
+    smallest ones, so small files keep draining alongside the big
+    ones.  A limited lane gives one file at a time, and only while
+    all its devices have a stream to spare.  When waiting, blocks
+    until another copier releases a device.  Returns false with
+    the index past the last file once there is nothing left to
+    take, or with the index unchanged if nothing can be taken
+    without waiting. */
+    WorkQueue* own(
+            (worker < this->_workQueues.size())
+            ? &(this->_workQueues[worker])
+            : nullptr
+        );
+    int kind(_worker_lane(worker));
+    if (own)
+    {
+        const std::lock_guard<std::mutex> ownLock(own->lock);
+        if (!own->files.empty())
+        {
+            *index = own->files.front();
+            own->files.pop_front();
+            return true;
+        }
+    }
+
+    std::unique_lock<std::mutex> lock(this->_sourceQueueLock);
+    while (true)
+    {
+        bool anyLane((kind < 0) || _lanes_drained(kind));
+        for (size_t n(0); this->_numUnclaimed && (n < this->_lanes.size()); ++n)
+        {
+            size_t laneIndex((this->_nextLane + n) % this->_lanes.size());
+            DeviceLane& lane = this->_lanes[laneIndex];
+            size_t batch(1);
+            if (lane.next >= lane.end) continue;
+            if (!anyLane && (lane.small != static_cast<bool>(kind))) continue;
+
+            if (lane.limited)
+            {
+                bool free(true);
+                for (dev_t device: lane.devices)
+                {
+                    DeviceSlots& slots = this->_devices[device];
+                    if (slots.limit && (slots.active >= slots.limit)) free = false;
+                }
+                if (!free) continue;
+                for (dev_t device: lane.devices)
+                {
+                    ++this->_devices[device].active;
+                }
+            }
+            else if (own)
+            {
+                batch = std::clamp(
+                        (lane.end - lane.next)
+                        / (WORK_BATCH_DIVISOR * this->_workQueues.size()),
+                        static_cast<size_t>(1),
+                        static_cast<size_t>(WORK_BATCH_MAX)
+                    );
+            }
+
+            *index = lane.indexes[lane.next++];
+            if (batch > 1)
+            {
+                const std::lock_guard<std::mutex> ownLock(own->lock);
+                own->files.insert(
+                        own->files.end(),
+                        lane.indexes.begin() + lane.end - (batch - 1),
+                        lane.indexes.begin() + lane.end
+                    );
+                lane.end -= batch - 1;
+            }
+            this->_numUnclaimed -= batch;
+            this->_nextLane = (laneIndex + 1) % this->_lanes.size();
+            return true;
+        }
+
+        if (_steal_files(worker, index, anyLane)) return true;
+        if (!this->_numUnclaimed)
+        {
+            *index = this->_gatherer.num_files();
+            return false;
+        }
+        if (!wait) return false;
+        this->_deviceFreed.wait(lock);
+    }
+}
+
+bool TreeSlinger::_steal_files(size_t worker, size_t* index, bool anyLane)
+{
+    /* Takes the back half of the first other copier's queue that
+    has files waiting, keeping all but one in the thief's own queue.
+    Only copiers of the same kind are robbed unless anyLane is set.
+    The caller holds the source queue lock. */
+    WorkQueue* own(
+            (worker < this->_workQueues.size())
+            ? &(this->_workQueues[worker])
+            : nullptr
+        );
+    int kind(_worker_lane(worker));
+
+    for (size_t n(1); n <= this->_workQueues.size(); ++n)
+    {
+        size_t victimIndex((worker + n) % this->_workQueues.size());
+        WorkQueue& victim = this->_workQueues[victimIndex];
+        if (&victim == own) continue;
+        if (!anyLane && (_worker_lane(victimIndex) != kind)) continue;
+
+        std::deque<size_t> stolen;
+        {
+            const std::lock_guard<std::mutex> victimLock(victim.lock);
+            size_t numStolen(own ? (victim.files.size() + 1) / 2 : 1);
+            if (!numStolen || victim.files.empty()) continue;
+            stolen.assign(victim.files.end() - numStolen, victim.files.end());
+            victim.files.erase(victim.files.end() - numStolen, victim.files.end());
+        }
+
+        *index = stolen.front();
+        if (stolen.size() > 1)
+        {
+            const std::lock_guard<std::mutex> ownLock(own->lock);
+            own->files.insert(own->files.end(), stolen.begin() + 1, stolen.end());
+        }
+        return true;
+    }
+    return false;
+}
+
+void TreeSlinger::_release_file(size_t index)
+{
+    /* Gives back the device streams a claimed file held.
+    Files on unlimited devices never took any. */
+    if (!_lane_limited(this->_fileLanes[index])) return;
+    {
+        const std::lock_guard<std::mutex> lock(this->_sourceQueueLock);
+        for (dev_t device: this->_lanes[this->_fileLanes[index]].devices)
+        {
+            --this->_devices[device].active;
+        }
+    }
+    this->_deviceFreed.notify_all();
+}
+
 int TreeSlinger::_get_next_dest_index()
 {
-    const std::lock_guard<std::mutex> lock(this->_destQueueLock);
     return this->_destQueueIndex++;
 }
 
+void TreeSlinger::_complete_file(size_t index)
+{
+    /* Hands a file that is fully written to the verifiers,
+    when copying and verifying overlap */
+    if (!this->_pipelined) return;
+    {
+        const std::lock_guard<std::mutex> lock(this->_completionLock);
+        this->_completedFiles.push_back(index);
+    }
+    this->_fileCompleted.notify_one();
+}
+
+void TreeSlinger::_run_verifier()
+{
+    /* Hashes files as copiers finish them, the source only if
+    its copier did not, until the copiers are done and every
+    finished file has been taken */
+    hashwrapper* hasher = _create_hasher();
+    std::vector<std::filesystem::path>* sources = this->_gatherer.get();
+    size_t index;
+
+    while (true)
+    {
+        {
+            std::unique_lock<std::mutex> lock(this->_completionLock);
+            this->_fileCompleted.wait(lock, [this]()
+            {
+                return !this->_completedFiles.empty() || this->_copiersDone;
+            });
+            if (this->_completedFiles.empty()) break;
+            index = this->_completedFiles.front();
+            this->_completedFiles.pop_front();
+        }
+
+        if (this->_sourceChecksums->at(index).empty())
+        {
+            this->_sourceChecksums->at(index) = hasher->getHashFromFile(
+                    sources->at(index).string()
+                );
+        }
+        this->_destChecksums->at(index) = hasher->getHashFromFile(
+                this->_destFiles->at(index).string()
+            );
+    }
+    delete hasher;
+}
+
 void TreeSlinger::_increment_progress(size_t chunk)
 {
     const std::lock_guard<std::mutex> lock(this->_progressLock);
     this->_progress.increment(chunk);
 }
 
+void TreeSlinger::_record_lane(
+        size_t index,
+        size_t numBytes,
+        std::chrono::steady_clock::time_point start
+    )
+{
+    /* Counts a copied file toward the small or large file lane,
+    which run from the first file starting to the last finishing */
+    std::chrono::steady_clock::time_point stop(std::chrono::steady_clock::now());
+    const std::lock_guard<std::mutex> lock(this->_progressLock);
+    LaneStats& stats = this->_laneStats[_is_small_file(index)];
+    if (!stats.numFiles || (start < stats.start)) stats.start = start;
+    if (!stats.numFiles || (stop > stats.stop)) stats.stop = stop;
+    ++stats.numFiles;
+    stats.numBytes += numBytes;
+}
+
+void TreeSlinger::_open_batch(
+        UringQueue* queue,
+        const std::vector<size_t>& indexes,
+        std::vector<int>* sourceFds,
+        std::vector<int>* destFds
+    )
+{
+    /* Opens the sources and creates the destinations of a batch
+    of files with one submission, or one call each without a
+    queue.  Destinations are not truncated, so existing ones can
+    still be skipped.  A descriptor that failed to open is -1 and
+    the copier opens that file by path instead. */
+    std::vector<std::filesystem::path>* sources = this->_gatherer.get();
+    UringCompletion completions[2 * SMALL_FILE_BATCH];
+    size_t numPending(0);
+
+    if (queue && !queue->supports(IORING_OP_OPENAT)) queue = nullptr;
+    sourceFds->assign(indexes.size(), -1);
+    destFds->assign(indexes.size(), -1);
+    for (size_t i(0); i < indexes.size(); ++i)
+    {
+        const char* source(sources->at(indexes[i]).c_str());
+        const char* dest(this->_destFiles->at(indexes[i]).c_str());
+        if (!queue)
+        {
+            sourceFds->at(i) = ::open(source, O_RDONLY);
+            destFds->at(i) = ::open(dest, O_WRONLY | O_CREAT, 0666);
+            continue;
+        }
+        queue->prep_openat(AT_FDCWD, source, O_RDONLY, 0, 2 * i);
+        queue->prep_openat(AT_FDCWD, dest, O_WRONLY | O_CREAT, 0666, 2 * i + 1);
+        numPending += 2;
+    }
+    if (!numPending) return;
+
+    queue->submit();
+    while (numPending)
+    {
+        unsigned numCompleted(queue->wait(completions, 2 * SMALL_FILE_BATCH));
+        for (unsigned i(0); i < numCompleted; ++i)
+        {
+            std::vector<int>* fds((completions[i].userData & 1) ? destFds : sourceFds);
+            fds->at(completions[i].userData / 2) = (
+                    (completions[i].result >= 0) ? completions[i].result : -1
+                );
+        }
+        numPending -= numCompleted;
+    }
+}
+
+void TreeSlinger::_close_batch(UringQueue* queue, std::vector<int>* fds)
+{
+    /* Closes every descriptor a batch of copies handed back.
+    Each close is tagged with its descriptor, so one the queue
+    failed to close is closed directly instead of leaking. */
+    UringCompletion completions[2 * SMALL_FILE_BATCH];
+    size_t numPending(0);
+    unsigned numCompleted;
+
+    if (queue && !queue->supports(IORING_OP_CLOSE)) queue = nullptr;
+    for (int fd: *fds)
+    {
+        if (!queue || !queue->available())
+        {
+            ::close(fd);
+            continue;
+        }
+        queue->prep_close(fd, static_cast<uint64_t>(fd));
+        ++numPending;
+    }
+    fds->clear();
+    if (!numPending) return;
+
+    queue->submit();
+    while (numPending)
+    {
+        numCompleted = queue->wait(completions, 2 * SMALL_FILE_BATCH);
+        for (unsigned i(0); i < numCompleted; ++i)
+        {
+            if (completions[i].result < 0)
+            {
+                ::close(static_cast<int>(completions[i].userData));
+            }
+        }
+        numPending -= numCompleted;
+    }
+}
+
+void TreeSlinger::_copy_small_batch(
+        FileCopy* copier,
+        size_t worker,
+        size_t first,
+        UringQueue* queue
+    )
+{
+    /* Copies a small file along with the other small files
+    queued behind it, opening them all at once beforehand and
+    closing them all at once afterwards, so the copier pays for
+    the metadata calls of a whole batch together */
+    std::vector<std::filesystem::path>* sources = this->_gatherer.get();
+    std::vector<size_t> indexes(1, first);
+    std::vector<int> sourceFds, destFds, closes;
+    size_t bytesCopied;
+
+    if (worker < this->_workQueues.size())
+    {
+        WorkQueue& own = this->_workQueues[worker];
+        const std::lock_guard<std::mutex> ownLock(own.lock);
+        while (
+                (indexes.size() < SMALL_FILE_BATCH)
+                && !own.files.empty()
+                && _is_small_file(own.files.front())
+            )
+        {
+            indexes.push_back(own.files.front());
+            own.files.pop_front();
+        }
+    }
+
+    _open_batch(queue, indexes, &sourceFds, &destFds);
+    copier->set_deferred_closes(&closes);
+    for (size_t i(0); i < indexes.size(); ++i)
+    {
+        size_t index(indexes[i]);
+        std::chrono::steady_clock::time_point start(std::chrono::steady_clock::now());
+        copier->reset();
+        copier->open_source(sources->at(index), sourceFds[i]);
+        copier->open_dest(this->_destFiles->at(index), destFds[i]);
+        _open_mirrors(copier, index);
+        bytesCopied = copier->execute();
+        this->_bytesMoved->at(index) = copier->bytes_moved();
+        _store_mirror_bytes(copier, index);
+        _store_block_digests(copier, index);
+        if (copier->hashed())
+        {
+            this->_sourceChecksums->at(index) = copier->get_source_checksum();
+        }
+        _release_file(index);
+        _complete_file(index);
+        _increment_progress(bytesCopied);
+        _record_lane(index, bytesCopied, start);
+    }
+    copier->set_deferred_closes(nullptr);
+    _close_batch(queue, &closes);
+}
+
 void TreeSlinger::_sys_file_copy()
 {
     /* Recursive file copy
@@ -203,23 +853,217 @@ void TreeSlinger::_sys_file_copy()
         );
 }
 
+bool TreeSlinger::_split_file(FileCopy* copier, size_t index)
+{
+    /* Sizes a partial destination for a large file and offers
+    its ranges to every copier.  The partial file only takes the
+    destination's name once it is whole, so an interrupted job
+    never leaves a full size destination behind.  Returns false
+    if the file is to be copied whole instead. */
+    std::vector<std::filesystem::path>* sources = this->_gatherer.get();
+    size_t size;
+
+    if (!this->_splitThreshold || (_num_copiers() < 2)) return false;
+    if (this->_resume || !this->_mirrorRoots.empty()) return false;
+
+    /* One clone shares the whole file; ranges would each clone it */
+    if (this->_reflink) return false;
+    if (_lane_limited(this->_fileLanes[index])) return false;
+    size = std::filesystem::file_size(sources->at(index));
+    if (size < this->_splitThreshold) return false;
+    if (!copier->_overwrite && std::filesystem::exists(this->_destFiles->at(index)))
+    {
+        return false;
+    }
+
+    std::filesystem::path partial(this->_destFiles->at(index));
+    partial += SPLIT_PARTIAL_SUFFIX;
+    {
+        std::ofstream created(partial, std::ios::binary);
+    }
+    std::filesystem::resize_file(partial, size);
+
+    const std::lock_guard<std::mutex> lock(this->_splitLock);
+    this->_splitFiles.push_back(SplitFile{
+            index,
+            size,
+            this->_splitRangeSize,
+            (size + this->_splitRangeSize - 1) / this->_splitRangeSize,
+            0, 0, 0
+        });
+    this->_splitFiles.back().rangesLeft = this->_splitFiles.back().numRanges;
+    return true;
+}
+
+bool TreeSlinger::_copy_split_range(FileCopy* copier)
+{
+    /* Claims and copies one range of a split file.
+    Returns false if no ranges are waiting. */
+    std::vector<std::filesystem::path>* sources = this->_gatherer.get();
+    SplitFile* split(nullptr);
+    size_t range, offset, bytesCopied;
+
+    {
+        const std::lock_guard<std::mutex> lock(this->_splitLock);
+        for (SplitFile& candidate: this->_splitFiles)
+        {
+            if (candidate.nextRange < candidate.numRanges)
+            {
+                split = &candidate;
+                break;
+            }
+        }
+        if (!split) return false;
+        range = split->nextRange++;
+    }
+
+    std::filesystem::path partial(this->_destFiles->at(split->index));
+    partial += SPLIT_PARTIAL_SUFFIX;
+
+    offset = range * split->rangeSize;
+    copier->reset();
+    copier->set_range(offset, std::min(split->rangeSize, split->size - offset));
+    copier->open_source(sources->at(split->index));
+    copier->open_dest(partial);
+    bytesCopied = copier->execute();
+    _increment_progress(bytesCopied);
+
+    const std::lock_guard<std::mutex> lock(this->_splitLock);
+    _store_block_digests(copier, split->index);
+    split->bytesMoved += bytesCopied;
+    if (!--split->rangesLeft)
+    {
+        std::filesystem::rename(partial, this->_destFiles->at(split->index));
+        this->_bytesMoved->at(split->index) = split->bytesMoved;
+        _complete_file(split->index);
+    }
+    return true;
+}
+
+void TreeSlinger::_store_block_digests(FileCopy* copier, size_t index)
+{
+    /* Keeps the block digests a copier recorded for a file.
+    Each range of a split file fills in its own blocks, so the
+    caller holds the split lock for those. */
+    const std::vector<block_digest>& recorded = copier->get_block_digests();
+    std::vector<block_digest>& digests = this->_blockDigests->at(index);
+
+    if (digests.size() < recorded.size())
+    {
+        digests.resize(recorded.size(), BLOCK_DIGEST_NONE);
+    }
+    for (size_t block(0); block < recorded.size(); ++block)
+    {
+        if (recorded[block] != BLOCK_DIGEST_NONE) digests[block] = recorded[block];
+    }
+}
+
+void TreeSlinger::_store_mirror_bytes(FileCopy* copier, size_t index)
+{
+    /* Keeps the bytes a copier wrote to each mirror of a file */
+    std::vector<size_t>& numBytes = this->_mirrorBytesMoved->at(index);
+    for (size_t mirror(0); mirror < numBytes.size(); ++mirror)
+    {
+        numBytes[mirror] = copier->mirror_bytes_moved(mirror);
+    }
+}
+
+void TreeSlinger::_record_copy_error(size_t index, file_mover_err err)
+{
+    /* Notes a file whose copy, or a mirror of it, failed,
+    so the copier can carry on with the next one */
+    this->_copyErrors->at(index) = err;
+    const std::lock_guard<std::mutex> lock(this->_printLock);
+    std::cerr << "Could not copy " << this->_destFiles->at(index).string();
+    std::cerr << " (error " << err << ")" << std::endl;
+}
+
+inline std::filesystem::path TreeSlinger::_get_mirror_dest(
+        size_t mirror,
+        std::filesystem::path destAsset
+    )
+{
+    return (
+            this->_mirrorRoots[mirror]
+            / destAsset.lexically_relative(this->destination)
+        ).lexically_normal();
+}
+
+void TreeSlinger::_open_mirrors(FileCopy* copier, size_t index)
+{
+    /* Gives a copier the same file under every mirror root,
+    after its destination has been opened */
+    for (size_t mirror(0); mirror < this->_mirrorRoots.size(); ++mirror)
+    {
+        copier->open_mirror(_get_mirror_dest(mirror, this->_destFiles->at(index)));
+    }
+}
+
 void TreeSlinger::_run_copier(FileCopy* copier, const size_t totalNumFiles)
 {
-    /* Runs a single FileCopy object until all files are copied */
-    size_t bytesCopied, index(_get_next_source_index());
+    /* Runs a single FileCopy object until all files are copied,
+    helping with ranges of split files before taking new ones.
+    Copiers serving the small file lanes copy in batches. */
+    size_t bytesCopied, index;
+    size_t worker(copier - this->_copiers.data());
     std::vector<std::filesystem::path>* sources = this->_gatherer.get();
-    while (index < totalNumFiles)
+    UringQueue batchQueue;
+    bool batched(
+            (_worker_lane(worker) == 1)
+            && !this->_direct
+            && this->_mirrorRoots.empty()
+        );
+    if (batched) batchQueue.setup(2 * SMALL_FILE_BATCH);
+
+    while (true)
     {
+        if (_copy_split_range(copier)) continue;
+        if (!_claim_file(worker, &index, true)) break;
+        if (batched && _is_small_file(index))
+        {
+            _copy_small_batch(
+                    copier,
+                    worker,
+                    index,
+                    batchQueue.ready() ? &batchQueue : nullptr
+                );
+            continue;
+        }
+        if (_split_file(copier, index))
+        {
+            _release_file(index);
+            continue;
+        }
+
+        std::chrono::steady_clock::time_point start(std::chrono::steady_clock::now());
         copier->reset();
-        std::this_thread::yield();
-        copier->open_source(sources->at(index));
-        std::this_thread::yield();
-        copier->open_dest(this->_destFiles->at(index));
-        std::this_thread::yield();
-        bytesCopied = copier->execute();
+        try
+        {
+            copier->open_source(sources->at(index));
+            copier->open_dest(this->_destFiles->at(index));
+            _open_mirrors(copier, index);
+            bytesCopied = copier->execute();
+        }
+        catch (file_mover_err err)
+        {
+            /* A destination or mirror that fails only costs this file */
+            copier->close();
+            _record_copy_error(index, err);
+            _release_file(index);
+            _complete_file(index);
+            continue;
+        }
+        this->_bytesMoved->at(index) = copier->bytes_moved();
+        _store_mirror_bytes(copier, index);
+        _store_block_digests(copier, index);
+        if (copier->hashed())
+        {
+            this->_sourceChecksums->at(index) = copier->get_source_checksum();
+        }
+        _release_file(index);
+        _complete_file(index);
         _increment_progress(bytesCopied);
-        std::this_thread::yield();
-        index = _get_next_source_index();
+        _record_lane(index, bytesCopied, start);
     }
 }
 
@@ -233,37 +1077,225 @@ void TreeSlinger::_spawn_thread(FileCopy* copier)
         ));
 }
 
+bool TreeSlinger::_start_uring_copy(
+        FileCopy* copier,
+        size_t* index,
+        std::chrono::steady_clock::time_point* start,
+        const size_t totalNumFiles
+    )
+{
+    /* Opens the next file that needs copying on a copier and
+    readies it for the queue, finishing skipped, cloned and small
+    files on the spot.  Copies the queue cannot drive, such as
+    continued or sparse ones, run on their own engine, so they
+    are too.  Returns false, leaving the copier idle, once there
+    are no files it can take while its devices are busy.
+    The time the queued file was started is kept in start. */
+    size_t bytesCopied;
+    size_t worker(copier - this->_copiers.data());
+    std::vector<std::filesystem::path>* sources = this->_gatherer.get();
+    while (_claim_file(worker, index, false))
+    {
+        *start = std::chrono::steady_clock::now();
+        copier->reset();
+        copier->open_source(sources->at(*index));
+        copier->open_dest(this->_destFiles->at(*index));
+        _open_mirrors(copier, *index);
+        if (
+                copier->should_skip()
+                || copier->_small_file()
+                || (copier->_effective_engine() != ENGINE_URING)
+            )
+        {
+            bytesCopied = copier->execute();
+        }
+        else if (copier->prepare())
+        {
+            return true;
+        }
+        else
+        {
+            /* Cloned, so there is nothing to queue */
+            bytesCopied = copier->finish();
+        }
+        _increment_progress(bytesCopied);
+        this->_bytesMoved->at(*index) = copier->bytes_moved();
+        _store_mirror_bytes(copier, *index);
+        _store_block_digests(copier, *index);
+        if (copier->hashed())
+        {
+            this->_sourceChecksums->at(*index) = copier->get_source_checksum();
+        }
+        _release_file(*index);
+        _complete_file(*index);
+        _record_lane(*index, bytesCopied, *start);
+    }
+    *index = totalNumFiles;
+    return false;
+}
+
+void TreeSlinger::_run_uring_copiers(const size_t totalNumFiles)
+{
+    /* Drives every copier from the calling thread through one
+    shared io_uring queue, so many files can be in flight at once
+    without a thread per copier */
+    UringQueue queue;
+    UringCompletion completions[64];
+    std::vector<size_t> indexes(_num_copiers(), totalNumFiles);
+    std::vector<std::chrono::steady_clock::time_point> starts(_num_copiers());
+    size_t bytesCopied;
+    int numActive(0);
+    unsigned numCompleted;
+
+    if (!this->_mirrorRoots.empty())
+    {
+        /* Mirrored files fan out from writer threads of their own,
+        which the queue cannot drive, so each copier gets a thread
+        as it would with the other engines */
+        std::cerr << "Mirrored copies do not use the shared io_uring queue; ";
+        std::cerr << "copying with a thread per copier" << std::endl;
+        for (int i(0); i < _num_copiers(); ++i)
+        {
+            _spawn_thread(&(this->_copiers[i]));
+        }
+        for (std::thread& copier: this->_threads)
+        {
+            copier.join();
+        }
+        this->_threads.clear();
+        return;
+    }
+
+    if (!queue.setup(this->_queueDepth * _num_copiers()))
+    {
+        /* Without io_uring, copy one file at a time */
+        _run_copier(&(this->_copiers[0]), totalNumFiles);
+        return;
+    }
+
+    for (int i(0); i < _num_copiers(); ++i)
+    {
+        this->_copiers[i].set_engine(ENGINE_URING);
+        this->_copiers[i].set_uring(&queue);
+        numActive += _start_uring_copy(
+                &(this->_copiers[i]),
+                &(indexes[i]),
+                &(starts[i]),
+                totalNumFiles
+            );
+    }
+
+    while (numActive)
+    {
+        for (int i(0); i < _num_copiers(); ++i)
+        {
+            if (indexes[i] < totalNumFiles) this->_copiers[i].uring_submit();
+        }
+
+        numCompleted = queue.wait(completions, 64);
+        for (unsigned i(0); i < numCompleted; ++i)
+        {
+            FileCopy::uring_dispatch(completions[i]);
+        }
+
+        for (int i(0); i < _num_copiers(); ++i)
+        {
+            if ((indexes[i] >= totalNumFiles) || !this->_copiers[i].uring_done())
+            {
+                continue;
+            }
+            bytesCopied = this->_copiers[i].finish();
+            _increment_progress(bytesCopied);
+            this->_bytesMoved->at(indexes[i]) = this->_copiers[i].bytes_moved();
+            _store_mirror_bytes(&(this->_copiers[i]), indexes[i]);
+            _store_block_digests(&(this->_copiers[i]), indexes[i]);
+            if (this->_copiers[i].hashed())
+            {
+                this->_sourceChecksums->at(indexes[i]) = this->_copiers[i].get_source_checksum();
+            }
+            _release_file(indexes[i]);
+            _complete_file(indexes[i]);
+            _record_lane(indexes[i], bytesCopied, starts[i]);
+            if (!_start_uring_copy(
+                        &(this->_copiers[i]),
+                        &(indexes[i]),
+                        &(starts[i]),
+                        totalNumFiles
+                    ))
+            {
+                --numActive;
+            }
+        }
+
+        /* Copiers left idle by busy devices pick up files that
+        the ones finishing have made room for */
+        for (int i(0); i < _num_copiers(); ++i)
+        {
+            if (indexes[i] < totalNumFiles) continue;
+            numActive += _start_uring_copy(
+                    &(this->_copiers[i]),
+                    &(indexes[i]),
+                    &(starts[i]),
+                    totalNumFiles
+                );
+        }
+    }
+
+    for (FileCopy& copier: this->_copiers)
+    {
+        copier.set_uring(nullptr);
+        _configure_copier(&copier);
+    }
+}
+
+hashwrapper* TreeSlinger::_create_hasher()
+{
+    /* Returns a new hasher for the job's algorithm, MD5 if unset.
+    The caller owns it. */
+    wrapperfactory factory;
+    hashwrapper* hasher = factory.create(
+            this->algorithm.empty() ? std::string("md5") : this->algorithm
+        );
+    if (!hasher)
+    {
+        throw UNKNOWN_HASH_ALGORITHM;
+    }
+    return hasher;
+}
+
 void TreeSlinger::_run_source_hasher(const size_t totalNumFiles)
 {
     size_t index(_get_next_source_index());
-    md5wrapper hasher;
+    hashwrapper* hasher = _create_hasher();
     std::string checksum;
     std::vector<std::filesystem::path>* sources = this->_gatherer.get();
     while (index < totalNumFiles)
     {
-        this->_sourceChecksums->at(index) = hasher.getHashFromFile(
-                sources->at(index).string()
-            );
-        std::this_thread::yield();
+        /* Sources hashed by their copier are not read again */
+        if (this->_sourceChecksums->at(index).empty())
+        {
+            this->_sourceChecksums->at(index) = hasher->getHashFromFile(
+                    sources->at(index).string()
+                );
+        }
         index = _get_next_source_index();
-        std::this_thread::yield();
     }
+    delete hasher;
 }
 
 void TreeSlinger::_run_dest_hasher(const size_t totalNumFiles)
 {
     size_t index(_get_next_dest_index());
-    md5wrapper hasher;
+    hashwrapper* hasher = _create_hasher();
     std::string checksum;
     while (index < totalNumFiles)
     {
-        this->_destChecksums->at(index) = hasher.getHashFromFile(
+        this->_destChecksums->at(index) = hasher->getHashFromFile(
                 this->_destFiles->at(index).string()
             );
-        std::this_thread::yield();
         index = _get_next_dest_index();
-        std::this_thread::yield();
     }
+    delete hasher;
 }
 
 void TreeSlinger::_spawn_source_hasher_thread()
@@ -297,6 +1329,10 @@ void TreeSlinger::_create_dest_dir_structure()
         #if _DEBUG
         std::cout << "Created directory " << redirected << std::endl;
         #endif
+        for (size_t mirror(0); mirror < this->_mirrorRoots.size(); ++mirror)
+        {
+            std::filesystem::create_directories(_get_mirror_dest(mirror, redirected));
+        }
     }
 }
 
@@ -338,6 +1374,21 @@ void TreeSlinger::_allocate_checksums()
     }
 }
 
+void TreeSlinger::_allocate_transfer_records()
+{
+    /* One entry per source file for the bytes physically written,
+    which stays zero for skipped and cloned files, for the bytes
+    written to each mirror, for the error that stopped it if any,
+    and for the block digests recorded while copying it */
+    this->_bytesMoved->assign(this->_gatherer.num_files(), 0);
+    this->_mirrorBytesMoved->assign(
+            this->_gatherer.num_files(),
+            std::vector<size_t>(this->_mirrorRoots.size(), 0)
+        );
+    this->_copyErrors->assign(this->_gatherer.num_files(), 0);
+    this->_blockDigests->assign(this->_gatherer.num_files(), std::vector<block_digest>());
+}
+
 bool TreeSlinger::_checksums_allocated()
 {
     return (
@@ -398,7 +1449,8 @@ void TreeSlinger::_create_csv()
     #endif
 
     report.open(filename.str(), std::ofstream::out);
-    report << "Filename," << this->algorithm << " Checksum" << std::endl;
+    report << "Filename," << this->algorithm << " Checksum,Bytes Moved";
+    report << std::endl;
 
     for (size_t i(0); i < numFiles; ++i)
     {
@@ -407,6 +1459,8 @@ void TreeSlinger::_create_csv()
         // report << this->_destChecksums->at(i);
         
         report << "placeholder_checksum";
+        report << ",";
+        report << this->_bytesMoved->at(i);
         
         report << std::endl;
     }
@@ -430,11 +1484,303 @@ void TreeSlinger::set_destination(std::filesystem::path destPath)
 void TreeSlinger::set_hash_algorithm(const char* algo)
 {
     this->algorithm = algo;
+    for (FileCopy& copier: this->_copiers)
+    {
+        _configure_copier(&copier);
+    }
 }
 
 void TreeSlinger::set_hash_inline(bool hashInline)
 {
-    this->_hashInline = true;
+    /* Copiers hash each source with the job's algorithm as it
+    passes through their ring slots, so verifying never reads the
+    source again.  Files the kernel copies or clones, and the
+    ranges of split files, are still hashed when verifying. */
+    this->_hashInline = hashInline;
+    for (FileCopy& copier: this->_copiers)
+    {
+        _configure_copier(&copier);
+    }
+}
+
+void TreeSlinger::set_reflink(bool reflink)
+{
+    /* Clone files instead of copying them when the source
+    and destination share a filesystem.  Files that cannot
+    be cloned are copied normally. */
+    this->_reflink = reflink;
+    for (FileCopy& copier: this->_copiers)
+    {
+        _configure_copier(&copier);
+    }
+}
+
+void TreeSlinger::set_threaded(bool threaded)
+{
+    /* Give each copier its own reader thread, so reads
+    and writes overlap within a file */
+    this->_threaded = threaded;
+    for (FileCopy& copier: this->_copiers)
+    {
+        _configure_copier(&copier);
+    }
+}
+
+void TreeSlinger::set_sparse(bool sparse)
+{
+    /* Preserve holes and skip zero blocks in every copied file */
+    this->_sparse = sparse;
+    for (FileCopy& copier: this->_copiers)
+    {
+        _configure_copier(&copier);
+    }
+}
+
+void TreeSlinger::set_preallocate(bool preallocate)
+{
+    /* Reserve each destination up front to limit fragmentation */
+    this->_preallocate = preallocate;
+    for (FileCopy& copier: this->_copiers)
+    {
+        _configure_copier(&copier);
+    }
+}
+
+void TreeSlinger::set_extent_hint(size_t numBytes)
+{
+    /* Extent size hint for large destination files */
+    this->_extentHint = numBytes;
+    for (FileCopy& copier: this->_copiers)
+    {
+        _configure_copier(&copier);
+    }
+}
+
+void TreeSlinger::set_cache_policy(cache_policy policy)
+{
+    /* Page cache advice for the whole job, so long offloads
+    need not push everything else out of memory */
+    this->_cachePolicy = policy;
+    for (FileCopy& copier: this->_copiers)
+    {
+        _configure_copier(&copier);
+    }
+}
+
+void TreeSlinger::set_small_file_threshold(size_t numBytes)
+{
+    /* Files up to this size skip the ring buffer entirely */
+    this->_smallFileThreshold = numBytes;
+    for (FileCopy& copier: this->_copiers)
+    {
+        _configure_copier(&copier);
+    }
+}
+
+void TreeSlinger::set_chunk_size(size_t numBytes)
+{
+    /* Ring slot size for every copier */
+    this->_chunkSize = numBytes;
+    for (FileCopy& copier: this->_copiers)
+    {
+        _configure_copier(&copier);
+    }
+}
+
+void TreeSlinger::set_ring_depth(uint8_t depth)
+{
+    /* Number of ring slots for every copier */
+    this->_ringDepth = depth;
+    for (FileCopy& copier: this->_copiers)
+    {
+        _configure_copier(&copier);
+    }
+}
+
+void TreeSlinger::set_adaptive_geometry(bool adaptive)
+{
+    /* Let copiers tune chunk size and ring depth per device
+    pair, starting from the job's geometry */
+    this->_adaptive = adaptive;
+    for (FileCopy& copier: this->_copiers)
+    {
+        _configure_copier(&copier);
+    }
+}
+
+void TreeSlinger::set_split_threshold(size_t numBytes)
+{
+    /* Smallest file shared between copiers; 0 never splits */
+    this->_splitThreshold = numBytes;
+}
+
+void TreeSlinger::set_split_range_size(size_t numBytes)
+{
+    /* Bytes per range of a split file, kept aligned for O_DIRECT */
+    numBytes = std::max(numBytes, static_cast<size_t>(RING_BUFFER_ALIGNMENT));
+    this->_splitRangeSize = (
+            (numBytes + RING_BUFFER_ALIGNMENT - 1)
+            / RING_BUFFER_ALIGNMENT
+            * RING_BUFFER_ALIGNMENT
+        );
+}
+
+void TreeSlinger::set_resume(bool resume)
+{
+    /* Continue partial destinations left by an interrupted job.
+    Files are then copied whole rather than split. */
+    this->_resume = resume;
+    for (FileCopy& copier: this->_copiers)
+    {
+        _configure_copier(&copier);
+    }
+}
+
+void TreeSlinger::set_checkpoint_interval(size_t numBytes)
+{
+    /* Bytes between source hash checkpoints of resumable copies */
+    this->_checkpointInterval = numBytes;
+    for (FileCopy& copier: this->_copiers)
+    {
+        _configure_copier(&copier);
+    }
+}
+
+void TreeSlinger::set_skip_policy(skip_policy policy)
+{
+    /* How existing destinations are checked before being skipped */
+    this->_skipPolicy = policy;
+    for (FileCopy& copier: this->_copiers)
+    {
+        _configure_copier(&copier);
+    }
+}
+
+void TreeSlinger::set_block_digest_size(size_t numBytes)
+{
+    /* Source bytes per block digest recorded while copying,
+    used by repair(); 0 records none */
+    this->_blockDigestSize = numBytes;
+    for (FileCopy& copier: this->_copiers)
+    {
+        _configure_copier(&copier);
+    }
+}
+
+void TreeSlinger::add_mirror_destination(std::filesystem::path mirrorPath)
+{
+    /* Writes the tree to another destination as well, from the
+    same reads of the source.  Only the destination itself is
+    hashed and verified.  Mirrored files are neither split nor
+    resumed, and with the io_uring engine each copier takes a
+    thread instead of sharing one queue. */
+    this->_mirrorRoots.push_back(std::filesystem::canonical(mirrorPath));
+}
+
+void TreeSlinger::set_mirror_lag(uint8_t numSlots)
+{
+    /* Ring slots the fastest destination of a mirrored file may
+    get ahead of the slowest before reading waits */
+    this->_mirrorLag = numSlots;
+    for (FileCopy& copier: this->_copiers)
+    {
+        _configure_copier(&copier);
+    }
+}
+
+void TreeSlinger::set_device_aware(bool deviceAware)
+{
+    /* Limit copiers per device by whether it spins, rather than
+    letting every copier take the next file.  Applies from the
+    next call to _stage(). */
+    this->_deviceAware = deviceAware;
+}
+
+void TreeSlinger::set_device_streams(unsigned rotational, unsigned solidState)
+{
+    /* Copiers allowed on one rotational or solid state device at
+    a time; 0 is unlimited.  Applies from the next call to _stage(). */
+    this->_rotationalStreams = rotational;
+    this->_solidStateStreams = solidState;
+}
+
+void TreeSlinger::set_largest_first(bool largestFirst)
+{
+    /* Hand out the largest files first, so no big file discovered
+    late is left running alone.  Applies from the next call to
+    _stage(). */
+    this->_largestFirst = largestFirst;
+}
+
+size_t TreeSlinger::get_predicted_spread()
+{
+    /* Bytes between the first and last copier to finish, as
+    predicted by _stage() */
+    return this->_predictedSpread;
+}
+
+size_t TreeSlinger::get_predicted_makespan()
+{
+    /* Bytes copied by the busiest copier, as predicted by _stage() */
+    return this->_predictedMakespan;
+}
+
+void TreeSlinger::set_small_file_workers(unsigned numWorkers)
+{
+    /* Copiers set aside for files at or under the small file
+    threshold, which they open, create and close in batches while
+    the rest stream the large files; 0 mixes them.  Needs more
+    copiers than this, and applies from the next call to _stage(). */
+    this->_smallFileWorkers = numWorkers;
+}
+
+double TreeSlinger::get_lane_throughput(bool smallFiles)
+{
+    /* Bytes per second through the small or large file lane */
+    const std::lock_guard<std::mutex> lock(this->_progressLock);
+    const LaneStats& stats = this->_laneStats[smallFiles];
+    std::chrono::duration<double> elapsed(stats.stop - stats.start);
+    return (elapsed.count() > 0) ? (stats.numBytes / elapsed.count()) : 0;
+}
+
+double TreeSlinger::get_lane_file_rate(bool smallFiles)
+{
+    /* Files per second through the small or large file lane */
+    const std::lock_guard<std::mutex> lock(this->_progressLock);
+    const LaneStats& stats = this->_laneStats[smallFiles];
+    std::chrono::duration<double> elapsed(stats.stop - stats.start);
+    return (elapsed.count() > 0) ? (stats.numFiles / elapsed.count()) : 0;
+}
+
+void TreeSlinger::set_engine(copy_engine engine)
+{
+    /* Selects the transfer engine used by every copier */
+    this->_engine = engine;
+    for (FileCopy& copier: this->_copiers)
+    {
+        _configure_copier(&copier);
+    }
+}
+
+void TreeSlinger::set_queue_depth(unsigned depth)
+{
+    /* Number of reads and writes each copier keeps in flight
+    with the io_uring engine */
+    this->_queueDepth = depth;
+    for (FileCopy& copier: this->_copiers)
+    {
+        _configure_copier(&copier);
+    }
+}
+
+void TreeSlinger::set_direct(bool direct)
+{
+    /* Copy with O_DIRECT to keep large jobs out of the page cache */
+    this->_direct = direct;
+    for (FileCopy& copier: this->_copiers)
+    {
+        _configure_copier(&copier);
+    }
 }
 
 std::vector<std::filesystem::path>* TreeSlinger::get_source_files()
@@ -505,6 +1851,8 @@ void TreeSlinger::_stage()
     _create_dest_dir_structure();
     _enumerate_dest_files();
     _allocate_checksums();
+    _allocate_transfer_records();
+    _group_by_device();
 }
 
 bool TreeSlinger::verify()
@@ -517,16 +1865,22 @@ bool TreeSlinger::verify()
     std::cout << "Verifying..." << std::endl;
     #endif
 
-    md5wrapper hasher;
+    hashwrapper* hasher = _create_hasher();
     size_t index(0), totalNumFiles = this->_gatherer.num_files();
     std::vector<std::filesystem::path>* sources = this->_gatherer.get();
     while (index < totalNumFiles)
     {
+        if (!this->_sourceChecksums->at(index).empty())
+        {
+            /* Already hashed by its copier */
+            ++index;
+            continue;
+        }
         #if _DEBUG
         std::cout << "Hashing file ";
         std::cout << sources->at(index).string() << std::endl;
         #endif
-        this->_sourceChecksums->at(index) = hasher.getHashFromFile(
+        this->_sourceChecksums->at(index) = hasher->getHashFromFile(
                 sources->at(index).string()
             );
         ++index;
@@ -539,11 +1893,12 @@ bool TreeSlinger::verify()
         std::cout << "Hashing file ";
         std::cout << this->_destFiles->at(index).string() << std::endl;
         #endif
-        this->_destChecksums->at(index) = hasher.getHashFromFile(
+        this->_destChecksums->at(index) = hasher->getHashFromFile(
                 this->_destFiles->at(index).string()
             );
         ++index;
     }
+    delete hasher;
     
     index = 0;
     while (index < totalNumFiles)
@@ -575,30 +1930,8 @@ bool TreeSlinger::verify()
     return true;
 }
 
-bool TreeSlinger::verify_threaded(int numThreads)
+bool TreeSlinger::_checksums_match()
 {
-    #if _DEBUG
-    if (this->_gatherer.num_files() != this->_destFiles->size())
-    {
-        throw FILE_NUM_MISMATCH;
-    }
-    std::cout << "Verifying..." << std::endl;
-    #endif
-
-    this->_sourceQueueIndex = 0;
-    this->_destQueueIndex = 0;
-    for (int i(0); i < numThreads; ++i)
-    {
-        _spawn_source_hasher_thread();
-        _spawn_dest_hasher_thread();
-    }
-
-    for (int i(0); i < numThreads; ++i)
-    {
-        this->_sourceHasherThreads[i].join();
-        this->_destHasherThreads[i].join();
-    }
-    
     size_t index(0), totalNumFiles = this->_gatherer.num_files();
     while (index < totalNumFiles)
     {
@@ -630,6 +1963,150 @@ bool TreeSlinger::verify_threaded(int numThreads)
     return true;
 }
 
+bool TreeSlinger::copy_and_verify(int numVerifiers)
+{
+    /* Copies with every copier on its own thread, or all of them
+    through one io_uring queue with that engine, while verifier
+    threads hash each file as soon as it is written, rather than
+    waiting for the whole job to finish */
+    #if _DEBUG
+    if (this->_gatherer.num_files() != this->_destFiles->size())
+    {
+        throw FILE_NUM_MISMATCH;
+    }
+    #endif
+
+    std::vector<std::thread> verifiers;
+    this->_pipelined = true;
+    this->_copiersDone = false;
+    this->_completedFiles.clear();
+
+    for (int i(0); i < numVerifiers; ++i)
+    {
+        verifiers.emplace_back(std::thread(&TreeSlinger::_run_verifier, this));
+    }
+    if (this->_engine == ENGINE_URING)
+    {
+        _run_uring_copiers(this->_gatherer.num_files());
+    }
+    else
+    {
+        for (int i(0); i < _num_copiers(); ++i)
+        {
+            _spawn_thread(&(this->_copiers[i]));
+        }
+        for (std::thread& copier: this->_threads)
+        {
+            copier.join();
+        }
+        this->_threads.clear();
+    }
+
+    {
+        const std::lock_guard<std::mutex> lock(this->_completionLock);
+        this->_copiersDone = true;
+    }
+    this->_fileCompleted.notify_all();
+    for (std::thread& verifier: verifiers)
+    {
+        verifier.join();
+    }
+    this->_pipelined = false;
+
+    return _checksums_match();
+}
+
+bool TreeSlinger::verify_threaded(int numThreads)
+{
+    #if _DEBUG
+    if (this->_gatherer.num_files() != this->_destFiles->size())
+    {
+        throw FILE_NUM_MISMATCH;
+    }
+    std::cout << "Verifying..." << std::endl;
+    #endif
+
+    this->_sourceQueueIndex = 0;
+    this->_destQueueIndex = 0;
+    for (int i(0); i < numThreads; ++i)
+    {
+        _spawn_source_hasher_thread();
+        _spawn_dest_hasher_thread();
+    }
+
+    for (int i(0); i < numThreads; ++i)
+    {
+        this->_sourceHasherThreads[i].join();
+        this->_destHasherThreads[i].join();
+    }
+    
+    return _checksums_match();
+}
+
+
+bool TreeSlinger::repair()
+{
+    /* Fixes the destinations verification found different from
+    their sources by rewriting only the damaged blocks, then hashes
+    them again.  Blocks are first checked against the digests
+    recorded while copying; if the file still differs, which it
+    does when the source was misread during the copy, every block
+    is compared with the source read again.
+    Returns false if any destination could not be repaired. */
+    std::vector<std::filesystem::path>* sources = this->_gatherer.get();
+    size_t totalNumFiles = this->_gatherer.num_files();
+    std::vector<block_digest> none;
+    hashwrapper* hasher = _create_hasher();
+    FileCopy copier;
+    bool repaired(true);
+
+    copier.set_block_digest_size(this->_blockDigestSize);
+    for (size_t index(0); index < totalNumFiles; ++index)
+    {
+        if (this->_sourceChecksums->at(index) == this->_destChecksums->at(index))
+        {
+            continue;
+        }
+
+        #if _DEBUG
+        std::cout << "Repairing " << this->_destFiles->at(index).string() << std::endl;
+        #endif
+
+        try
+        {
+            for (const std::vector<block_digest>* digests: {&(this->_blockDigests->at(index)), &none})
+            {
+                this->_bytesMoved->at(index) += copier.repair(
+                        sources->at(index),
+                        this->_destFiles->at(index),
+                        *digests
+                    );
+                this->_destChecksums->at(index) = hasher->getHashFromFile(
+                        this->_destFiles->at(index).string()
+                    );
+                if (this->_sourceChecksums->at(index) == this->_destChecksums->at(index))
+                {
+                    break;
+                }
+            }
+        }
+        catch (file_mover_err err)
+        {
+            #if _DEBUG
+            std::cerr << "Could not repair " << this->_destFiles->at(index).string();
+            std::cerr << " (error " << err << ")" << std::endl;
+            #endif
+        }
+
+        if (this->_sourceChecksums->at(index) != this->_destChecksums->at(index))
+        {
+            repaired = false;
+        }
+    }
+
+    delete hasher;
+    return repaired;
+}
 
 // size_t TreeSlinger::execute()
 // {
@@ -645,3 +2122,22 @@ std::vector<std::string>* TreeSlinger::get_dest_checksums() const
 {
     return this->_destChecksums;
 }
+
+std::vector<size_t>* TreeSlinger::get_bytes_moved() const
+{
+    return this->_bytesMoved;
+}
+
+std::vector<std::vector<size_t>>* TreeSlinger::get_mirror_bytes_moved() const
+{
+    /* Bytes written to each mirror, per source file,
+    in the order the mirrors were added */
+    return this->_mirrorBytesMoved;
+}
+
+std::vector<int>* TreeSlinger::get_copy_errors() const
+{
+    /* The file_mover_err that stopped each source file's copy,
+    or 0 where it succeeded */
+    return this->_copyErrors;
+}